@@ -0,0 +1,16 @@
+#!/bin/bash
+
+CYAN='\033[1;36m' # Cyan
+NC='\033[0m' # No Color
+
+cd /mnt/c/Users/alexa/Documents/KUL/BigData/Assignment1/Assignment1_BigData/build && make && cd ..
+
+# Accuracy against sketch size, with and without conservative update. Every
+# step in --log-buckets halves the memory of the sketch.
+echo -e ${CYAN}----------- sweep: sketch size x conservative update -----------${NC}
+/mnt/c/Users/alexa/Documents/KUL/BigData/Assignment1/Assignment1_BigData/build/src/bdap_assignment1 sweep bash_ouput_countmin_conservative.csv \
+  --clf nb-countmin \
+  --window 100 \
+  --log-buckets 8,9,10,11,12,13,14,15,16,17 \
+  --num-hashes 3,5 \
+  --conservative 0,1
@@ -7,12 +7,24 @@
  * Version: 0.1
  */
 
+#include <cmath>
 #include <unordered_map> // std::hash for std::string_view
+#include <utility>
+#include <vector>
+#include "counters.hpp"
 #include "email.hpp"
+#include "hashed_email.hpp"
 #include "murmurhash.hpp"
+#include "span.hpp"
 
 namespace bdap {
 
+/** How the Naive Bayes models lay out the counts of the two classes. */
+enum class BucketLayout {
+    by_class,    // all ham counts, followed by all spam counts
+    interleaved, // the ham and spam counts of a bucket next to each other
+};
+
 /**
  * A base class for your classifiers.
  * Your implementations should extend this class as follows:
@@ -23,8 +35,15 @@ namespace bdap {
  *     };
  * ```
  * Your class will fail to compile if it does not implement the methods
- *  - `update(const Email&)`
- *  - `predict(const Email&) const`
+ *  - `update_(const HashedEmail&)`
+ *  - `predict_(const HashedEmail&) const`
+ *  - `predict_batch_(span<const HashedEmail>, span<double>) const`
+ *  - `hasher() const`
+ * and can override `predict_and_update_(const HashedEmail&)` to compute the
+ * prediction and the update in one pass over the email.
+ *
+ * The n-grams of an email are hashed once (see `hash_email`), after which
+ * the hashed email can be passed to `predict` and `update` repeatedly.
  *
  * You must follow this structure for ease of grading.
  *
@@ -43,40 +62,116 @@ public:
     int ngram_k = 3;
     double threshold = 0.0;
 
+    /** Hash n-grams by combining the hashes of their words rather than by
+     * hashing the n-gram text (see `FeatureHasher::compositional`). */
+    bool compositional_ngrams = false;
+
     /** Update the paramters of the model using the incoming email (online
      * learning). */
     void update(const Email& email)
+    { update(hash_email(email)); }
+
+    void update(const HashedEmail& email)
     {
         ++num_examples_processed;
         static_cast<Derived *>(this)->update_(email);
     }
 
+    /** Prequential (test-then-train) learning: predict `email` with the
+     * current model, then update the model with it. Returns the prediction
+     * from before the update, i.e. `predict(email)`. */
+    double learn_one(const Email& email)
+    { return learn_one(hash_email(email)); }
+
+    double learn_one(const HashedEmail& email)
+    {
+        ++num_examples_processed;
+        return static_cast<Derived *>(this)->predict_and_update_(email);
+    }
+
     /** Use the current model to make a prediction about the given email. */
     double predict(const Email& email) const
+    { return predict(hash_email(email)); }
+
+    double predict(const HashedEmail& email) const
     {
         return static_cast<const Derived *>(this)->predict_(email);
     }
 
+    /** Predict a batch of emails at once: `out[i]` is set to
+     * `predict(emails[i])`. Implementations can look up the buckets of the
+     * whole batch together, which keeps more memory accesses in flight. */
+    void predict_batch(span<const HashedEmail> emails, span<double> out) const
+    {
+        static_cast<const Derived *>(this)->predict_batch_(emails, out);
+    }
+
+    void predict_batch(span<const Email> emails, span<double> out) const
+    {
+        std::vector<HashedEmail> hashed;
+        hashed.reserve(emails.size());
+        for (const Email& email : emails)
+            hashed.push_back(hash_email(email));
+        predict_batch(hashed, out);
+    }
+
     /** Threshold the prediction given by `predict` by `threshold` to get a
      * concrete classification. */
     bool classify(const Email& email) const
     { return classify(predict(email)); }
 
+    bool classify(const HashedEmail& email) const
+    { return classify(predict(email)); }
+
     bool classify(double pr) const
     { return pr > threshold; }
 
     /* UTILITY FUNCTIONS */
 
     static size_t hash(std::string_view key, size_t seed)
+    { return hash_ngram(key, seed); }
+
+    /** `std::log(count)`, looked up in a table for small counts. */
+    static double log_count(size_t count)
+    { return bdap::log_count(count); }
+
+    /** Hint the CPU to start loading `p` into the cache. */
+    static void prefetch(const void *p)
     {
-        uint64_t out[2] = {0};
-        MurmurHash3_x64_128(key.data(), key.size(), seed, &out);
-        return out[0] ^ out[1];
+#if defined(__GNUC__)
+        __builtin_prefetch(p);
+#endif
     }
 
+    /** Number of lookups a batched prediction prefetches ahead. */
+    static constexpr size_t PREFETCH_DISTANCE = 16;
+
+    /** Hash the n-grams of `email` the way this classifier expects them. */
+    HashedEmail hash_email(const Email& email) const
+    { return HashedEmail(email, static_cast<const Derived *>(this)->hasher()); }
+
+protected:
+    /** A hasher for the current `ngram_k` and n-gram hashing mode. */
+    FeatureHasher make_hasher(std::vector<size_t> seeds, bool double_hashing = false) const
+    {
+        return FeatureHasher{ngram_k, std::move(seeds), double_hashing,
+                             compositional_ngrams};
+    }
+
+public:
     /* IMPLEMENT THESE METHODS IN YOUR SUBCLASSES */
-    void update_(const Email& email);
-    double predict_(const Email& email) const;
+    void update_(const HashedEmail& email);
+    double predict_(const HashedEmail& email) const;
+    void predict_batch_(span<const HashedEmail> emails, span<double> out) const;
+    FeatureHasher hasher() const;
+
+    /* OPTIONALLY OVERRIDE THIS METHOD */
+    double predict_and_update_(const HashedEmail& email)
+    {
+        double pr = static_cast<const Derived *>(this)->predict_(email);
+        static_cast<Derived *>(this)->update_(email);
+        return pr;
+    }
 };
 
 } // namespace bdap
@@ -0,0 +1,250 @@
+/*
+ * Micro-benchmarks of the hot paths: hashing, tokenization, n-gram
+ * iteration, and `predict`/`update` of the four classifiers for several
+ * table sizes and n-gram lengths. They run on a synthetic corpus whose word
+ * frequencies follow Zipf's law, so no data files are needed.
+ *
+ * Usage: ./bdap_bench [--emails N] [--min-time seconds] [--filter substring]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "email.hpp"
+#include "hashed_email.hpp"
+#include "murmurhash.hpp"
+#include "profile.hpp"
+
+#include "naive_bayes_feature_hashing.hpp"
+#include "perceptron_feature_hashing.hpp"
+#include "naive_bayes_count_min.hpp"
+#include "perceptron_count_min.hpp"
+
+using namespace bdap;
+
+/** Parameters of the synthetic corpus. */
+constexpr size_t VOCABULARY_SIZE = 50000;
+constexpr double ZIPF_EXPONENT = 1.1;
+constexpr size_t MIN_WORDS = 50;
+constexpr size_t MAX_WORDS = 500;
+
+/** The text of a corpus of `num_emails` emails, in the format that
+ * `read_emails` parses. Spam and ham draw their words from the same Zipf
+ * distribution over differently ordered vocabularies. */
+std::string synthetic_corpus(size_t num_emails, unsigned seed)
+{
+    std::mt19937_64 rng(seed);
+
+    std::vector<std::string> vocabulary;
+    for (size_t i = 0; i < VOCABULARY_SIZE; ++i)
+    {
+        std::string word;
+        for (size_t n = i + 1; n > 0; n /= 26)
+            word.push_back(static_cast<char>('a' + n % 26));
+        vocabulary.push_back(word);
+    }
+    std::vector<size_t> spam_rank(VOCABULARY_SIZE);
+    for (size_t i = 0; i < spam_rank.size(); ++i)
+        spam_rank[i] = i;
+    std::shuffle(spam_rank.begin(), spam_rank.begin() + 1000, rng);
+
+    std::vector<double> weights(VOCABULARY_SIZE);
+    for (size_t i = 0; i < weights.size(); ++i)
+        weights[i] = 1.0 / std::pow(static_cast<double>(i + 1), ZIPF_EXPONENT);
+    std::discrete_distribution<size_t> zipf(weights.begin(), weights.end());
+    std::uniform_int_distribution<size_t> length(MIN_WORDS, MAX_WORDS);
+
+    std::string text;
+    for (size_t e = 0; e < num_emails; ++e)
+    {
+        bool spam = rng() % 2 == 0;
+        text += spam ? "EMAIL> label=1 synthetic\n" : "EMAIL> label=0 synthetic\n";
+        size_t num_words = length(rng);
+        for (size_t w = 0; w < num_words; ++w)
+        {
+            size_t rank = zipf(rng);
+            text += vocabulary[spam ? spam_rank[rank] : rank];
+            text += (w + 1) % 16 == 0 ? '\n' : ' ';
+        }
+        text += "\n\n";
+    }
+    return text;
+}
+
+struct Bench
+{
+    size_t num_emails = 0; // in the parsed corpus, which every run processes
+    double min_time = 0.2;
+    std::string filter;
+
+    /** Time `run()`, which processes every email of the corpus once, until
+     * at least `min_time` seconds have passed, and print the time per
+     * email. */
+    template <typename F>
+    void operator()(const std::string& name, F run) const
+    {
+        if (name.find(filter) == std::string::npos)
+            return;
+
+        using clock = std::chrono::steady_clock;
+        run(); // warm up
+        size_t reps = 0;
+        auto begin = clock::now();
+        double seconds = 0.0;
+        do
+        {
+            run();
+            ++reps;
+            seconds = std::chrono::duration<double>(clock::now() - begin).count();
+        } while (seconds < min_time);
+
+        double per_email = seconds / (reps * num_emails);
+        std::printf("%-48s %12.1f ns/email %14.0f emails/s\n", name.c_str(),
+                    per_email * 1e9, 1.0 / per_email);
+    }
+};
+
+/** Keeps the benchmarked results from being optimized away. */
+volatile double sink;
+
+/** Benchmark `update` and `predict` of a classifier from `make_clf()` on
+ * the pre-hashed emails, so that hashing is not included. */
+template <typename MakeClf>
+void bench_clf(const Bench& bench, const std::string& name, MakeClf make_clf,
+               const std::vector<Email>& emails, int ngram_k)
+{
+    auto clf = make_clf();
+    clf.ngram_k = ngram_k;
+    clf.compositional_ngrams = true;
+    std::vector<HashedEmail> hashed;
+    for (const Email& email : emails)
+        hashed.push_back(clf.hash_email(email));
+
+    bench(name + " update", [&]() {
+        for (const HashedEmail& email : hashed)
+            clf.update(email);
+    });
+    bench(name + " predict", [&]() {
+        double sum = 0.0;
+        for (const HashedEmail& email : hashed)
+            sum += clf.predict(email);
+        sink = sum;
+    });
+}
+
+int main(int argc, char *argv[])
+{
+    Bench bench;
+    size_t num_emails = 2000;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string opt{argv[i]};
+        if (opt == "--emails") num_emails = std::stoul(argv[i+1]);
+        else if (opt == "--min-time") bench.min_time = std::stod(argv[i+1]);
+        else if (opt == "--filter") bench.filter = argv[i+1];
+        else
+        {
+            std::cerr << "Usage: ./bdap_bench [--emails N] [--min-time seconds] [--filter substring]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    auto text = std::make_shared<const std::string>(synthetic_corpus(num_emails, 12));
+    std::vector<Email> emails;
+    read_emails(*text, text, emails);
+    if (emails.empty())
+    {
+        std::cerr << "The synthetic corpus has no emails" << std::endl;
+        return 1;
+    }
+    bench.num_emails = emails.size();
+    size_t num_words = 0;
+    for (const Email& email : emails)
+        num_words += email.num_words();
+    std::cout << "Synthetic corpus: " << emails.size() << " emails, " << num_words << " words, "
+              << text->size() << " bytes" << std::endl;
+
+    bench("MurmurHash3_x64_128 words", [&]() {
+        uint64_t sum = 0;
+        for (const Email& email : emails)
+        {
+            for (size_t i = 0; i < email.num_words(); ++i)
+            {
+                std::string_view word = email.get_word(i);
+                uint64_t out[2];
+                MurmurHash3_x64_128(word.data(), static_cast<int>(word.size()), 0x249cd, out);
+                sum += out[0] ^ out[1];
+            }
+        }
+        sink = static_cast<double>(sum);
+    });
+
+    bench("Email tokenize", [&]() {
+        size_t sum = 0;
+        for (const Email& email : emails)
+            sum += Email(email.header(), email.body(), text).num_words();
+        sink = static_cast<double>(sum);
+    });
+
+    for (int k : {1, 3})
+    {
+        std::string suffix = " k=" + std::to_string(k);
+        bench("EmailIter" + suffix, [&]() {
+            size_t sum = 0;
+            for (const Email& email : emails)
+                for (EmailIter iter(email, k); iter; )
+                    sum += iter.next().size();
+            sink = static_cast<double>(sum);
+        });
+
+        for (bool compositional : {false, true})
+        {
+            FeatureHasher hasher{k, {0x249cd}, false, compositional};
+            bench(std::string(compositional ? "HashedEmail compositional" : "HashedEmail") + suffix, [&]() {
+                size_t sum = 0;
+                for (const Email& email : emails)
+                    sum += HashedEmail(email, hasher).num_ngrams();
+                sink = static_cast<double>(sum);
+            });
+        }
+    }
+
+    for (int log_num_buckets : {12, 17, 22})
+    {
+        for (int k : {1, 3})
+        {
+            std::string suffix = " b=" + std::to_string(log_num_buckets) + " k=" + std::to_string(k);
+            bench_clf(bench, "NaiveBayesFeatureHashing" + suffix, [&]() {
+                return NaiveBayesFeatureHashing{log_num_buckets, 0.5, BucketLayout::interleaved};
+            }, emails, k);
+            bench_clf(bench, "NaiveBayesCountMin" + suffix, [&]() {
+                return NaiveBayesCountMin<Counter32, 3>{3, log_num_buckets, 0.5, true, BucketLayout::interleaved};
+            }, emails, k);
+            bench_clf(bench, "PerceptronFeatureHashing" + suffix, [&]() {
+                return PerceptronFeatureHashing{log_num_buckets, 0.8};
+            }, emails, k);
+            bench_clf(bench, "PerceptronCountMin" + suffix, [&]() {
+                return PerceptronCountMin<DoubleWeight, 3>{3, log_num_buckets, 0.8, true};
+            }, emails, k);
+
+            // the same 3 rows as a run-time count, for the gain of `NumHashes`
+            bench_clf(bench, "NaiveBayesCountMin dynamic-rows" + suffix, [&]() {
+                return NaiveBayesCountMin<Counter32>{3, log_num_buckets, 0.5, true, BucketLayout::interleaved};
+            }, emails, k);
+            bench_clf(bench, "PerceptronCountMin dynamic-rows" + suffix, [&]() {
+                return PerceptronCountMin<DoubleWeight>{3, log_num_buckets, 0.8, true};
+            }, emails, k);
+        }
+    }
+
+    print_profile(std::cout);
+    return 0;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+#include "binary_io.hpp"
+#include "email.hpp"
+#include "profile.hpp"
+
+namespace bdap {
+
+/*
+ * Pre-tokenized binary corpus format, written by `bdap_convert`.
+ *
+ * All integers are stored in native byte order, and every section starts at
+ * a multiple of 8 bytes:
+ *
+ *     BinaryCorpusHeader
+ *     uint64_t text_offsets[num_emails+1]  // start of header+body in `text`
+ *     uint64_t word_index[num_emails+1]    // start of words in `word_offsets`
+ *     uint32_t header_sizes[num_emails]
+ *     uint32_t word_offsets[num_word_offsets] // `Email::words()`, per email
+ *     uint8_t  labels[num_emails]          // 1 for spam, 0 for ham
+ *     char     text[num_text_bytes]        // header followed by body
+ *
+ * Reading it back is a matter of pointing `Email`s into the mapped file.
+ */
+
+constexpr char BINARY_CORPUS_MAGIC[8] = {'B', 'D', 'A', 'P', 'E', 'M', 'L', '\0'};
+constexpr uint32_t BINARY_CORPUS_VERSION = 1;
+
+struct BinaryCorpusHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t num_emails;
+    uint64_t num_word_offsets;
+    uint64_t num_text_bytes;
+};
+
+/** Does `data` start with the magic bytes of a binary corpus? */
+inline bool is_binary_corpus(std::string_view data)
+{
+    return data.size() >= sizeof(BinaryCorpusHeader)
+        && std::memcmp(data.data(), BINARY_CORPUS_MAGIC, sizeof(BINARY_CORPUS_MAGIC)) == 0;
+}
+
+inline void write_binary_corpus(std::ostream& os, const std::vector<Email>& emails)
+{
+    std::vector<uint64_t> text_offsets{0};
+    std::vector<uint64_t> word_index{0};
+    std::vector<uint32_t> header_sizes;
+    std::vector<uint32_t> word_offsets;
+    std::vector<uint8_t> labels;
+    for (const Email& email : emails)
+    {
+        text_offsets.push_back(text_offsets.back() + email.header().size() + email.body().size());
+        header_sizes.push_back(static_cast<uint32_t>(email.header().size()));
+        word_offsets.insert(word_offsets.end(), email.words().begin(), email.words().end());
+        word_index.push_back(word_offsets.size());
+        labels.push_back(email.is_spam() ? 1 : 0);
+    }
+
+    BinaryCorpusHeader header{};
+    std::memcpy(header.magic, BINARY_CORPUS_MAGIC, sizeof(header.magic));
+    header.version = BINARY_CORPUS_VERSION;
+    header.num_emails = emails.size();
+    header.num_word_offsets = word_offsets.size();
+    header.num_text_bytes = text_offsets.back();
+
+    os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    detail::write_section(os, text_offsets);
+    detail::write_section(os, word_index);
+    detail::write_section(os, header_sizes);
+    detail::write_section(os, word_offsets);
+    detail::write_section(os, labels);
+    for (const Email& email : emails)
+    {
+        os.write(email.header().data(), email.header().size());
+        os.write(email.body().data(), email.body().size());
+    }
+
+    if (!os)
+        throw std::runtime_error("failed to write binary corpus");
+}
+
+/**
+ * Read the emails of the binary corpus `data` into `emails`. The emails are
+ * views into `data`, which must be owned by `storage`.
+ *
+ * Throws `std::runtime_error` if `data` is truncated or its offsets do not
+ * fit, so that a corrupt file cannot make the emails point outside of it.
+ */
+inline void read_binary_corpus(std::string_view data, const std::shared_ptr<const void>& storage,
+                               std::vector<Email>& emails)
+{
+    BDAP_PHASE(parse);
+    if (!is_binary_corpus(data))
+        throw std::runtime_error("not a binary corpus");
+
+    BinaryCorpusHeader header;
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (header.version != BINARY_CORPUS_VERSION)
+        throw std::runtime_error("unsupported binary corpus version");
+
+    // every email takes more than one byte, which also keeps n+1 from
+    // overflowing
+    if (header.num_emails >= data.size())
+        throw std::runtime_error("binary corpus truncated");
+    size_t n = header.num_emails;
+    size_t pos = sizeof(header);
+    auto text_offsets = detail::read_section<uint64_t>(data, pos, n+1);
+    auto word_index = detail::read_section<uint64_t>(data, pos, n+1);
+    auto header_sizes = detail::read_section<uint32_t>(data, pos, n);
+    auto word_offsets = detail::read_section<uint32_t>(data, pos, header.num_word_offsets);
+    detail::read_section<uint8_t>(data, pos, n); // labels, also in the headers
+    if (pos > data.size() || header.num_text_bytes > data.size() - pos)
+        throw std::runtime_error("binary corpus truncated");
+    std::string_view text = data.substr(pos, header.num_text_bytes);
+
+    emails.reserve(emails.size() + n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (text_offsets[i] > text_offsets[i+1] || text_offsets[i+1] > text.size()
+                || word_index[i] >= word_index[i+1] || word_index[i+1] > header.num_word_offsets)
+            throw std::runtime_error("binary corpus has invalid offsets");
+        std::string_view email = text.substr(text_offsets[i], text_offsets[i+1] - text_offsets[i]);
+        // `Email::is_spam` reads the label at offset 13 of the header
+        if (header_sizes[i] < 14 || header_sizes[i] > email.size())
+            throw std::runtime_error("binary corpus has an invalid email header");
+        std::string_view body = email.substr(header_sizes[i]);
+
+        std::vector<uint32_t> words(word_offsets + word_index[i], word_offsets + word_index[i+1]);
+        for (size_t j = 0; j < words.size(); ++j)
+            if (words[j] > body.size() || (j > 0 && words[j] < words[j-1]))
+                throw std::runtime_error("binary corpus has invalid word offsets");
+        emails.emplace_back(email.substr(0, header_sizes[i]), body, storage, std::move(words));
+    }
+}
+
+} // namespace bdap
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+namespace bdap {
+
+/*
+ * Helpers for the binary file formats (`binary_corpus.hpp`,
+ * `snapshot.hpp`). Sections are arrays in native byte order, padded to a
+ * multiple of 8 bytes so that every section is aligned in a mapped file.
+ */
+
+namespace detail {
+
+inline size_t align8(size_t n) { return (n + 7) & ~size_t{7}; }
+
+template <typename T>
+void write_section(std::ostream& os, const T *data, size_t count)
+{
+    os.write(reinterpret_cast<const char *>(data), count * sizeof(T));
+    static const char zeros[8] = {0};
+    size_t n = count * sizeof(T);
+    os.write(zeros, align8(n) - n);
+}
+
+template <typename T>
+void write_section(std::ostream& os, const std::vector<T>& v)
+{ write_section(os, v.data(), v.size()); }
+
+/** The `count` elements of type `T` at `pos` in `data`, which is then moved
+ * to the next section. Throws `std::runtime_error` if `data` is too short. */
+template <typename T>
+const T *read_section(std::string_view data, size_t& pos, size_t count)
+{
+    if (count > std::numeric_limits<size_t>::max() / sizeof(T))
+        throw std::runtime_error("binary data truncated");
+    size_t n = count * sizeof(T);
+    if (pos > data.size() || n > data.size() - pos)
+        throw std::runtime_error("binary data truncated");
+    const T *p = reinterpret_cast<const T *>(data.data() + pos);
+    pos += align8(n);
+    return p;
+}
+
+} // namespace detail
+
+} // namespace bdap
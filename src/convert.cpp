@@ -0,0 +1,47 @@
+/*
+ * Convert a text corpus (`EMAIL> ` framed) into the pre-tokenized binary
+ * corpus format of `binary_corpus.hpp`, which `bdap_assignment1` loads
+ * without parsing.
+ */
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "binary_corpus.hpp"
+#include "email.hpp"
+#include "mapped_file.hpp"
+
+using namespace bdap;
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        std::cerr << "Usage: ./bdap_convert <corpus.txt> <corpus.bin>" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        auto file = std::make_shared<const MappedFile>(argv[1]);
+        std::vector<Email> emails;
+        read_emails(file->view(), file, emails);
+
+        std::ofstream out(argv[2], std::ios::binary);
+        if (!out.is_open())
+            throw std::runtime_error(std::string("cannot open ") + argv[2]);
+        write_binary_corpus(out, emails);
+
+        std::cout << "Wrote " << emails.size() << " emails to " << argv[2] << std::endl;
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 2;
+    }
+
+    return 0;
+}
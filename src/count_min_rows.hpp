@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace bdap {
+
+/** `NumHashes` of a Count-Min classifier whose number of rows is only known
+ * at run time. */
+constexpr int DYNAMIC_ROWS = 0;
+
+/**
+ * The number of rows of a Count-Min sketch. It converts to an `int`, which
+ * is the constant `N` unless `N` is `DYNAMIC_ROWS`, so that loops over the
+ * rows have compile-time bounds and are unrolled.
+ *
+ * Throws `std::invalid_argument` if the number of rows given at run time
+ * does not match `N`.
+ */
+template <int N>
+struct CountMinRows
+{
+    explicit CountMinRows(int num_hashes)
+    {
+        if (num_hashes != N)
+            throw std::invalid_argument("expected " + std::to_string(N) + " hashes, got "
+                                        + std::to_string(num_hashes));
+    }
+
+    constexpr operator int() const { return N; }
+};
+
+template <>
+struct CountMinRows<DYNAMIC_ROWS>
+{
+    int n;
+
+    explicit CountMinRows(int num_hashes) : n(num_hashes) {}
+
+    operator int() const { return n; }
+};
+
+namespace detail {
+
+/** Order `a` and `b` without branches. */
+inline void sort2(double& a, double& b)
+{
+    double lo = std::min(a, b);
+    b = std::max(a, b);
+    a = lo;
+}
+
+} // namespace detail
+
+/**
+ * The median of the `N` values at `v`, with a branch-free sorting network
+ * for `N` in {3, 5, 7}. Reorders `v`. Use `has_median_network` to check
+ * whether there is a network for `N`.
+ */
+template <int N>
+double median_network(double *v);
+
+template <int N>
+constexpr bool has_median_network()
+{ return N == 3 || N == 5 || N == 7; }
+
+template <>
+inline double median_network<3>(double *v)
+{
+    return std::max(std::min(v[0], v[1]), std::min(std::max(v[0], v[1]), v[2]));
+}
+
+template <>
+inline double median_network<5>(double *v)
+{
+    using detail::sort2;
+    sort2(v[0], v[1]); sort2(v[3], v[4]); sort2(v[0], v[3]);
+    sort2(v[1], v[4]); sort2(v[1], v[2]); sort2(v[2], v[3]);
+    sort2(v[1], v[2]);
+    return v[2];
+}
+
+template <>
+inline double median_network<7>(double *v)
+{
+    using detail::sort2;
+    sort2(v[0], v[5]); sort2(v[0], v[3]); sort2(v[1], v[6]);
+    sort2(v[2], v[4]); sort2(v[0], v[1]); sort2(v[3], v[5]);
+    sort2(v[2], v[6]); sort2(v[2], v[3]); sort2(v[3], v[6]);
+    sort2(v[4], v[5]); sort2(v[1], v[4]); sort2(v[1], v[3]);
+    sort2(v[3], v[4]);
+    return v[3];
+}
+
+} // namespace bdap
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace bdap {
+
+/** `std::log(count)`, looked up in a table for small counts. */
+inline double log_count(size_t count)
+{
+    constexpr size_t TABLE_SIZE = 1 << 16;
+    static const std::vector<double> table = []() {
+        std::vector<double> t(TABLE_SIZE);
+        for (size_t i = 0; i < t.size(); ++i)
+            t[i] = std::log(static_cast<double>(i));
+        return t;
+    }();
+    if (count < TABLE_SIZE)
+        return table[count];
+    return std::log(static_cast<double>(count));
+}
+
+/** A small, fast random number generator (xorshift64*) for probabilistic
+ * counters. */
+struct CounterRng
+{
+    uint64_t state = 0x853c49e6748fea9b;
+
+    /** Restart the generator at a state derived from `seed`, e.g. to give
+     * copies of a sketch independent sequences. */
+    void seed(uint64_t seed)
+    { state = (seed * 0x9e3779b97f4a7c15) | 1; } // xorshift needs a nonzero state
+
+    /** Uniform in [0, 1). */
+    double uniform()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return ((state * 0x2545f4914f6cdd1d) >> 11) * 0x1.0p-53;
+    }
+};
+
+/*
+ * Counter types for the count tables of the Naive Bayes sketches. A counter
+ * type defines
+ *  - `value_type`: what is stored per bucket,
+ *  - `increment(c, rng)`: count one more occurrence, false if `c` is
+ *    saturated and cannot count any higher,
+ *  - `merge(c, o, rng)`: add the count of `o`, less the initial 1, to `c`
+ *    (see `NaiveBayesFeatureHashing::merge`), false if `c` saturated,
+ *  - `log_value(c)`: the log of the count that `c` represents,
+ *  - `cache_logs`: whether the sketch should keep a per-bucket table of
+ *    `log_value` (see `NaiveBayesFeatureHashing::log_buckets_`). Counters
+ *    with few distinct values look their logs up by value instead, which
+ *    keeps the sketch small,
+ *  - `snapshot_id`: identifies the counter type in model snapshots.
+ * A stored value of 1 represents a count of 1 for all counter types.
+ */
+
+/** An exact counter that sticks at the largest value of `T`. */
+template <typename T>
+struct SaturatingCounter
+{
+    using value_type = T;
+    static constexpr bool cache_logs = sizeof(T) >= 4;
+    static constexpr uint32_t snapshot_id = sizeof(T);
+
+    static bool increment(T& c, CounterRng&)
+    {
+        if (c == std::numeric_limits<T>::max())
+            return false;
+        ++c;
+        return true;
+    }
+
+    static bool merge(T& c, T o, CounterRng&)
+    {
+        T room = std::numeric_limits<T>::max() - c;
+        if (o - 1 > room)
+        {
+            c = std::numeric_limits<T>::max();
+            return false;
+        }
+        c += o - 1;
+        return true;
+    }
+
+    static double log_value(T c)
+    { return log_count(c); }
+};
+
+using Counter32 = SaturatingCounter<uint32_t>;
+using Counter16 = SaturatingCounter<uint16_t>;
+using Counter8 = SaturatingCounter<uint8_t>;
+
+/**
+ * An approximate Morris counter in 8 bits. It stores an exponent `c` that
+ * is incremented with probability `BASE^-c`, and represents the count
+ * `(BASE^c - 1) / (BASE - 1)`. With `BASE` 1.08 it counts up to about 4e9
+ * with a relative error of about 20%.
+ */
+struct MorrisCounter8
+{
+    using value_type = uint8_t;
+    static constexpr bool cache_logs = false;
+    static constexpr uint32_t snapshot_id = 0x108;
+    static constexpr double BASE = 1.08;
+
+    static bool increment(uint8_t& c, CounterRng& rng)
+    {
+        static const std::vector<double> probability = []() {
+            std::vector<double> t(256);
+            for (size_t i = 0; i < t.size(); ++i)
+                t[i] = std::pow(BASE, -static_cast<double>(i));
+            return t;
+        }();
+        if (c == std::numeric_limits<uint8_t>::max())
+            return false;
+        if (rng.uniform() < probability[c])
+            ++c;
+        return true;
+    }
+
+    /** The exponent whose count is closest to the sum of both counts, less
+     * the initial 1, rounded up at random so that the count stays unbiased. */
+    static bool merge(uint8_t& c, uint8_t o, CounterRng& rng)
+    {
+        double count = value(c) + value(o) - 1.0;
+        while (c < std::numeric_limits<uint8_t>::max() && value(c + 1) <= count)
+            ++c;
+        if (c == std::numeric_limits<uint8_t>::max())
+            return false;
+        double fraction = (count - value(c)) / (value(c + 1) - value(c));
+        if (rng.uniform() < fraction)
+            ++c;
+        return true;
+    }
+
+    static double value(uint8_t c)
+    { return (std::pow(BASE, c) - 1.0) / (BASE - 1.0); }
+
+    static double log_value(uint8_t c)
+    {
+        static const std::vector<double> table = []() {
+            std::vector<double> t(256);
+            for (size_t i = 0; i < t.size(); ++i)
+                t[i] = std::log(value(static_cast<uint8_t>(i)));
+            return t;
+        }();
+        return table[c];
+    }
+};
+
+} // namespace bdap
@@ -7,41 +7,48 @@
  * Version: 0.1
  */
 
-#include <fstream>
-#include <sstream>
+#include <cstdint>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 #include <vector>
+#include "profile.hpp"
 
 namespace bdap {
 
 class Email {
-    std::string header_;
-    std::string body_;
-    std::vector<size_t> words_; // offsets into `body_`
+    std::shared_ptr<const void> storage_; // keeps `header_` and `body_` alive
+    std::string_view header_;
+    std::string_view body_;
+    std::vector<uint32_t> words_; // offsets into `body_`
 
 public:
+    /** An email that owns a copy of its header and body. */
     Email(const std::string& header, const std::string& body)
-            : header_(header)
+            : Email(std::make_shared<const std::string>(header + body),
+                    header.size())
+    {}
+
+    /** An email whose header and body are views into memory owned by
+     * `storage`, e.g. a memory-mapped corpus file. */
+    Email(std::string_view header, std::string_view body,
+          std::shared_ptr<const void> storage)
+            : storage_(std::move(storage))
+            , header_(header)
             , body_(body)
             , words_{}
-    {
-        // find start indices of words in body
-        size_t prev = 0;
-        for (size_t i = 0; i < body_.size(); ++i)
-        {
-            char c = body_[i];
-            if (c == ' ' || c == '\n')
-            {
-                words_.push_back(prev);
-                prev = i+1;
-            }
-        }
-        if (prev != body_.size()) // omit if last char is space
-            words_.push_back(prev);
-        words_.push_back(body_.size());
-    }
+    { find_words(); }
+
+    /** Like above, but with the word offsets already known (see
+     * `binary_corpus.hpp`), so the body does not have to be scanned. */
+    Email(std::string_view header, std::string_view body,
+          std::shared_ptr<const void> storage, std::vector<uint32_t> words)
+            : storage_(std::move(storage))
+            , header_(header)
+            , body_(body)
+            , words_(std::move(words))
+    {}
 
     // careful with return string_view: 
     // https://stackoverflow.com/questions/46032307/how-to-efficiently-get-a-string-view-for-a-substring-of-stdstring
@@ -54,16 +61,42 @@ public:
         size_t index0 = words_[i];
         size_t index1 = words_[i+k]-1;
 
-        std::string_view body_view = body_;
-        return body_view.substr(index0, index1-index0);
+        return body_.substr(index0, index1-index0);
     }
 
     std::string_view get_word(size_t i) const { return get_ngram(i, 1); }
     size_t num_words() const { return words_.size()-1; }
 
-    const std::string& body() const { return body_; }
-    const std::string& header() const { return header_; }
+    std::string_view body() const { return body_; }
+    std::string_view header() const { return header_; }
+    const std::vector<uint32_t>& words() const { return words_; }
     bool is_spam() const { return header_[13] == '1'; /* EMAIL> label=X */ }
+
+private:
+    Email(std::shared_ptr<const std::string> text, size_t header_size)
+            : Email(std::string_view(*text).substr(0, header_size),
+                    std::string_view(*text).substr(header_size),
+                    text)
+    {}
+
+    void find_words()
+    {
+        BDAP_PHASE(tokenize);
+        // find start indices of words in body
+        size_t prev = 0;
+        for (size_t i = 0; i < body_.size(); ++i)
+        {
+            char c = body_[i];
+            if (c == ' ' || c == '\n')
+            {
+                words_.push_back(prev);
+                prev = i+1;
+            }
+        }
+        if (prev != body_.size()) // omit if last char is space
+            words_.push_back(prev);
+        words_.push_back(body_.size());
+    }
 };
 
 class EmailIter {
@@ -110,38 +143,72 @@ public:
     }
 };
 
-void read_emails(std::ifstream& f, std::vector<Email>& emails)
+/**
+ * Split the corpus text `data` into chunks of roughly `chunk_size` bytes
+ * that can be passed to `read_emails` independently. Every chunk but the
+ * first starts at an `EMAIL> ` header line, so no email is cut in two, and
+ * reading the chunks in order gives the same emails as reading `data`.
+ */
+std::vector<std::string_view> split_emails(std::string_view data, size_t chunk_size)
+{
+    std::vector<std::string_view> chunks;
+    size_t begin = 0;
+    while (begin < data.size())
+    {
+        size_t end = data.size();
+        if (data.size() - begin > chunk_size)
+        {
+            end = data.find("\nEMAIL> ", begin + chunk_size);
+            end = (end == std::string_view::npos) ? data.size() : end+1;
+        }
+        chunks.push_back(data.substr(begin, end-begin));
+        begin = end;
+    }
+    return chunks;
+}
+
+/**
+ * Split the corpus text `data` into emails without copying it. Each email
+ * starts with an `EMAIL> ` header line and ends at the next empty line; its
+ * body is a view of the lines in between, including their newlines.
+ * `storage` must own the memory of `data`.
+ *
+ * Lines between the empty line that ends an email and the next header
+ * belong to no email and are skipped, as is an email without an ending
+ * empty line at the end of `data`. The former line-based loader instead
+ * prepended such lines to the body of the next email, which a view of
+ * `data` cannot do. `split_emails` and `CorpusReader` rely on this: they
+ * cut the text right before a header, so the skipped lines do not depend on
+ * where it is cut.
+ */
+void read_emails(std::string_view data, const std::shared_ptr<const void>& storage,
+                 std::vector<Email>& emails)
 {
-    std::stringstream wordsbuf;
-    std::string line;
-    std::string header;
-    int label = -1;
-    int lineno = 0;
-    while (std::getline(f, line))
+    BDAP_PHASE(parse);
+    std::string_view header;
+    size_t body_begin = 0;
+    size_t pos = 0;
+    while (pos < data.size())
     {
-        ++lineno;
+        size_t eol = data.find('\n', pos);
+        if (eol == std::string_view::npos)
+            eol = data.size();
+        std::string_view line = data.substr(pos, eol-pos);
 
-        //std::cout << "> '" << l << "'\n";
         if (line.empty() && !header.empty()) // empty newline indicating the end of an email
         {
-            //if (header.empty())
-            //{
-            //    std::cerr << "line number " << lineno << std::endl;
-            //    throw std::runtime_error("invalid state");
-            //}
-            auto body = wordsbuf.str();
-            wordsbuf.clear();
-            wordsbuf.str("");
-            emails.emplace_back(header, body);
-            header.clear();
+            emails.emplace_back(header, data.substr(body_begin, pos-body_begin), storage);
+            header = {};
         }
             // header starting with `EMAIL> ` with path to email file
-        else if (line.find("EMAIL> ", 0) == 0)
-            std::swap(header, line);
-        else
-            wordsbuf << line; // concat line to email
+        else if (line.compare(0, 7, "EMAIL> ") == 0)
+        {
+            header = line;
+            body_begin = eol+1;
+        }
+
+        pos = eol+1;
     }
 }
 
-
 } // namespace bdap
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "email.hpp"
+#include "span.hpp"
+
+namespace bdap {
+
+/**
+ * Reads the emails of text corpus files one at a time, in file order. The
+ * files are read in blocks of `block_size` bytes, and every email is copied
+ * out of its block into memory of its own, so at most one block is held at
+ * a time, whatever the size of the corpus. The emails are those that
+ * `read_emails` finds in each file.
+ *
+ * Throws `std::runtime_error` if a file cannot be opened.
+ */
+class CorpusReader {
+    std::vector<std::string> fnames_;
+    size_t next_file_ = 0;
+    std::ifstream in_;
+    size_t block_size_;
+    std::string pending_; // read, but not a complete email yet
+    std::deque<Email> parsed_;
+
+public:
+    explicit CorpusReader(std::vector<std::string> fnames, size_t block_size = 4 * 1024 * 1024)
+        : fnames_(std::move(fnames)), block_size_(block_size) {}
+
+    /** The next email, or nothing at the end of the last file. */
+    std::optional<Email> next()
+    {
+        while (parsed_.empty())
+            if (!read_block())
+                return std::nullopt;
+        std::optional<Email> email{std::move(parsed_.front())};
+        parsed_.pop_front();
+        return email;
+    }
+
+private:
+    /** Parse the complete emails of the next block. False at the end. */
+    bool read_block()
+    {
+        if (!in_.is_open())
+        {
+            if (next_file_ == fnames_.size())
+                return false;
+            const std::string& fname = fnames_[next_file_++];
+            in_.open(fname, std::ios::binary);
+            if (!in_.is_open())
+                throw std::runtime_error("cannot open " + fname);
+        }
+
+        size_t size = pending_.size();
+        pending_.resize(size + block_size_);
+        in_.read(&pending_[size], block_size_);
+        pending_.resize(size + in_.gcount());
+
+        // only parse up to the last header, the email after it may not be
+        // complete yet (see `split_emails`)
+        size_t end = pending_.size();
+        if (in_)
+        {
+            end = pending_.rfind("\nEMAIL> ");
+            end = end == std::string::npos ? 0 : end + 1;
+        }
+        else
+        {
+            // like `read_emails`, which `load_emails` uses, drop a last email
+            // that does not end with an empty line
+            in_.close();
+            end = pending_.size();
+        }
+
+        std::vector<Email> views;
+        read_emails(std::string_view(pending_).substr(0, end), nullptr, views);
+        for (const Email& email : views)
+            parsed_.push_back(copy(email));
+        pending_.erase(0, end);
+        return true;
+    }
+
+    /** A copy of `email` that owns its text. */
+    static Email copy(const Email& email)
+    {
+        auto text = std::make_shared<std::string>(email.header().size() + email.body().size(), '\0');
+        std::memcpy(&(*text)[0], email.header().data(), email.header().size());
+        std::memcpy(&(*text)[email.header().size()], email.body().data(), email.body().size());
+        std::string_view v(*text);
+        return Email(v.substr(0, email.header().size()), v.substr(email.header().size()),
+                     std::move(text), email.words());
+    }
+};
+
+/**
+ * A stream of the emails of text corpus files that holds at most
+ * `buffer_size` of them in memory, for corpora too large to load at once
+ * (see `stream_emails`).
+ *
+ * The emails are shuffled approximately with a shuffle buffer: the buffer
+ * is filled with the first `buffer_size` emails, and every next email is
+ * drawn from it at random and replaced by the next email of the corpus. An
+ * email can so move back by any amount, but forward by at most about
+ * `buffer_size`. The order only depends on `seed`. A `buffer_size` of 0
+ * keeps the file order.
+ */
+class EmailStream {
+    CorpusReader reader_;
+    size_t buffer_size_;
+    std::vector<Email> buffer_;
+    std::vector<Email> window_;
+    std::default_random_engine rng_;
+
+public:
+    EmailStream(std::vector<std::string> fnames, size_t buffer_size, int seed,
+                size_t block_size = 4 * 1024 * 1024)
+        : reader_(std::move(fnames), block_size), buffer_size_(buffer_size), rng_(seed) {}
+
+    /** The next `n` emails, fewer at the end of the stream. They stay valid
+     * until the next call. */
+    span<const Email> next(size_t n)
+    {
+        window_.clear();
+        while (window_.size() < n)
+        {
+            std::optional<Email> email = next();
+            if (!email)
+                break;
+            window_.push_back(std::move(*email));
+        }
+        return window_;
+    }
+
+    /** The next email, or nothing at the end of the stream. */
+    std::optional<Email> next()
+    {
+        while (buffer_.size() < buffer_size_)
+        {
+            std::optional<Email> email = reader_.next();
+            if (!email)
+                break;
+            buffer_.push_back(std::move(*email));
+        }
+        if (buffer_.empty())
+            return reader_.next();
+
+        size_t i = std::uniform_int_distribution<size_t>(0, buffer_.size() - 1)(rng_);
+        std::optional<Email> email{std::move(buffer_[i])};
+        std::optional<Email> replacement = reader_.next();
+        if (replacement)
+        {
+            buffer_[i] = std::move(*replacement);
+        }
+        else
+        {
+            if (i != buffer_.size() - 1)
+                buffer_[i] = std::move(buffer_.back());
+            buffer_.pop_back();
+        }
+        return email;
+    }
+};
+
+} // namespace bdap
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include "email.hpp"
+#include "murmurhash.hpp"
+#include "profile.hpp"
+
+namespace bdap {
+
+/** MurmurHash3 of `key`, with the two 64-bit halves folded into one. */
+inline uint64_t hash_ngram(std::string_view key, size_t seed)
+{
+    uint64_t out[2] = {0};
+    MurmurHash3_x64_128(key.data(), key.size(), seed, &out);
+    return out[0] ^ out[1];
+}
+
+/** The seed of the first row of the Count-Min models. */
+constexpr size_t COUNT_MIN_SEED = 0x9748cd;
+
+/**
+ * Derive the `i`-th seed of a family of hash functions from `seed`. The
+ * seeds are mixed so that neighbouring rows of a sketch are independent.
+ */
+inline size_t derive_seed(size_t seed, size_t i)
+{
+    if (i == 0)
+        return seed;
+    return fmix64(seed + i * BIG_CONSTANT(0x9e3779b97f4a7c15)) & 0xffffffff;
+}
+
+/**
+ * Combine the hash of an n-gram with the hash of the word that follows it
+ * into the hash of the (n+1)-gram.
+ */
+inline uint64_t combine_hash(uint64_t ngram, uint64_t word)
+{
+    return fmix64(ngram ^ (word + BIG_CONSTANT(0x9e3779b97f4a7c15)
+                           + (ngram << 6) + (ngram >> 2)));
+}
+
+/**
+ * Describes how the n-grams of an email are hashed: which n-grams are
+ * extracted (`ngram_k`), and with which seeds each of them is hashed. Two
+ * classifiers with equal hashers can share the same `HashedEmail`.
+ *
+ * With `double_hashing`, each n-gram is hashed once with the first seed and
+ * both 64-bit halves of the MurmurHash3 output are kept, so that any number
+ * of hash values can be derived as `h1 + i * h2` (Kirsch & Mitzenmacher).
+ * The Count-Min models make `h2` odd, so that the values stay distinct
+ * modulo their power-of-two table sizes.
+ *
+ * With `compositional`, only the words are hashed with MurmurHash3, and the
+ * hash of a k-gram is built from the hash of its (k-1)-gram prefix and its
+ * last word using `combine_hash`. The hashing cost is then linear in the
+ * number of words instead of in the number of bytes of all n-grams.
+ */
+struct FeatureHasher {
+    int ngram_k;
+    std::vector<size_t> seeds;
+    bool double_hashing = false;
+    bool compositional = false;
+
+    /** Number of 64-bit values stored per n-gram. */
+    size_t stride() const
+    { return double_hashing ? 2 : seeds.size(); }
+
+    bool operator==(const FeatureHasher& o) const
+    {
+        return ngram_k == o.ngram_k && seeds == o.seeds
+            && double_hashing == o.double_hashing
+            && compositional == o.compositional;
+    }
+
+    bool operator!=(const FeatureHasher& o) const
+    { return !(*this == o); }
+};
+
+/**
+ * The n-grams of an email, hashed once up front so that `predict`, `update`
+ * and the per-class passes of the classifiers do not re-hash the email text.
+ *
+ * Every n-gram is hashed with each seed of the hasher, or once in both
+ * halves when double hashing. The hashes are stored n-gram major: the
+ * `stride()` hashes of n-gram `i` are adjacent.
+ */
+class HashedEmail {
+    std::vector<uint64_t> hashes_;
+    size_t stride_;
+    bool is_spam_;
+
+public:
+    HashedEmail(const Email& email, const FeatureHasher& hasher)
+            : hashes_{}
+            , stride_(hasher.stride())
+            , is_spam_(email.is_spam())
+    {
+        BDAP_PHASE(hash);
+        EmailIter iter = EmailIter(email, hasher.ngram_k);
+        hashes_.reserve(iter.size() * stride_);
+        if (hasher.compositional)
+        {
+            hash_compositional(email, hasher);
+            return;
+        }
+        while (iter)
+            push_hashes(iter.next(), hasher);
+    }
+
+    /** The `j`-th stored hash of n-gram `i`. */
+    uint64_t hash(size_t i, size_t j = 0) const
+    { return hashes_[i * stride_ + j]; }
+
+    /** Pointer to the `stride()` hashes of n-gram `i`. */
+    const uint64_t *ngram(size_t i) const
+    { return hashes_.data() + i * stride_; }
+
+    size_t num_ngrams() const { return stride_ == 0 ? 0 : hashes_.size() / stride_; }
+    size_t stride() const { return stride_; }
+    bool is_spam() const { return is_spam_; }
+
+private:
+    void push_hashes(std::string_view key, const FeatureHasher& hasher)
+    {
+        if (hasher.double_hashing)
+        {
+            uint64_t out[2] = {0};
+            MurmurHash3_x64_128(key.data(), key.size(), hasher.seeds[0], &out);
+            hashes_.push_back(out[0]);
+            hashes_.push_back(out[1]);
+        }
+        else
+        {
+            for (size_t seed : hasher.seeds)
+                hashes_.push_back(hash_ngram(key, seed));
+        }
+    }
+
+    // Same layout as `EmailIter`: all 1-grams, then all 2-grams, etc. The
+    // k-gram at word i is its (k-1)-gram at word i combined with word i+k-1.
+    void hash_compositional(const Email& email, const FeatureHasher& hasher)
+    {
+        size_t num_words = email.num_words();
+        size_t ngram_k = std::min(static_cast<size_t>(hasher.ngram_k), num_words);
+
+        for (size_t i = 0; i < num_words; ++i)
+            push_hashes(email.get_word(i), hasher);
+
+        size_t prev = 0; // index of the first (k-1)-gram
+        for (size_t k = 2; k <= ngram_k; ++k)
+        {
+            size_t cur = hashes_.size() / stride_;
+            for (size_t i = 0; i + k <= num_words; ++i)
+            {
+                for (size_t j = 0; j < stride_; ++j)
+                {
+                    uint64_t h = combine_hash(hash(prev + i, j), hash(i + k - 1, j));
+                    hashes_.push_back(h);
+                }
+            }
+            prev = cur;
+        }
+    }
+};
+
+} // namespace bdap
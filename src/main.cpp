@@ -9,13 +9,26 @@
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <random>
+#include <sstream>
 #include <stdexcept>
 #include <vector>
 
 #include "email.hpp"
+#include "hashed_email.hpp"
+#include "mapped_file.hpp"
 #include "metric.hpp"
+#include "parallel.hpp"
+#include "parallel_training.hpp"
+#include "profile.hpp"
+#include "stream.hpp"
+#include "sweep.hpp"
 #include "base_classifier.hpp"
+#include "binary_corpus.hpp"
+#include "email_stream.hpp"
+#include "snapshot.hpp"
 
 #include "naive_bayes_feature_hashing.hpp"
 #include "perceptron_feature_hashing.hpp"
@@ -28,42 +41,106 @@ using std::chrono::steady_clock;
 using std::chrono::milliseconds;
 using std::chrono::duration_cast;
 
-void load_emails(std::vector<Email>& emails, const std::string& fname)
+/** A part of a corpus file that can be read independently of the rest. */
+struct CorpusChunk
 {
-    std::ifstream f(fname);
-    if (!f.is_open())
+    std::shared_ptr<const MappedFile> file;
+    std::string_view data;
+    bool binary;
+};
+
+/** Text corpora are split into chunks of this size to be read in parallel. */
+constexpr size_t CHUNK_SIZE = 16 * 1024 * 1024;
+
+void open_corpus(std::vector<CorpusChunk>& chunks, const std::string& fname)
+{
+    std::shared_ptr<const MappedFile> file;
+    try
+    {
+        file = std::make_shared<const MappedFile>(fname);
+    }
+    catch (const std::runtime_error&)
     {
         std::cerr << "Failed to open file `" << fname << "`, skipping..." << std::endl;
+        return;
     }
+
+    if (is_binary_corpus(file->view()))
+        chunks.push_back({file, file->view(), true});
     else
-    {
-        steady_clock::time_point begin = steady_clock::now();
-        read_emails(f, emails);
-        steady_clock::time_point end = steady_clock::now();
+        for (std::string_view chunk : split_emails(file->view(), CHUNK_SIZE))
+            chunks.push_back({file, chunk, false});
+}
 
-        std::cout << "Read " << fname << " in "
-                  << (duration_cast<milliseconds>(end-begin).count()/1000.0)
-                  << "s" << std::endl;
-    }
+/** The binary corpus `<name>.bin` written by `bdap_convert` if it exists next
+ * to the text corpus `fname`, and the text corpus otherwise. */
+std::string corpus_file(const std::string& fname)
+{
+    std::string binfname = fname.substr(0, fname.rfind('.')) + ".bin";
+    if (std::ifstream(binfname).good())
+        return binfname;
+    return fname;
 }
 
-std::vector<Email> load_emails(int seed)
+/**
+ * Read the given corpus files. The files, and the chunks of large text
+ * files, are parsed concurrently, and the results are concatenated in file
+ * and chunk order so that the email order does not depend on the threads.
+ */
+void load_emails(std::vector<Email>& emails, const std::vector<std::string>& fnames)
 {
-    std::vector<Email> emails;
+    steady_clock::time_point begin = steady_clock::now();
+
+    std::vector<CorpusChunk> chunks;
+    for (const std::string& fname : fnames)
+        open_corpus(chunks, corpus_file(fname));
+
+    std::vector<std::vector<Email>> parsed(chunks.size());
+    parallel_for(chunks.size(), default_num_threads(), [&](size_t i) {
+        const CorpusChunk& chunk = chunks[i];
+        if (chunk.binary)
+            read_binary_corpus(chunk.data, chunk.file, parsed[i]);
+        else
+            read_emails(chunk.data, chunk.file, parsed[i]);
+    });
+
+    size_t num_emails = emails.size();
+    for (const std::vector<Email>& p : parsed)
+        num_emails += p.size();
+    emails.reserve(num_emails);
+    for (std::vector<Email>& p : parsed)
+        std::move(p.begin(), p.end(), std::back_inserter(emails));
+
+    steady_clock::time_point end = steady_clock::now();
+    std::cout << "Read " << fnames.size() << " files (" << chunks.size() << " chunks) in "
+              << (duration_cast<milliseconds>(end-begin).count()/1000.0)
+              << "s" << std::endl;
+}
 
+/** The corpus files of the assignment. */
+std::vector<std::string> corpus_files()
+{
     // Windows
-//    load_emails(emails, "C:\\Users\\alexa\\Documents\\KUL\\BigData\\Assignment1\\Assignment1_BigData\\data\\Enron.txt");
-//    load_emails(emails,"C:\\Users\\alexa\\Documents\\KUL\\BigData\\Assignment1\\Assignment1_BigData\\data\\SpamAssasin.txt");
-//    load_emails(emails,"C:\\Users\\alexa\\Documents\\KUL\\BigData\\Assignment1\\Assignment1_BigData\\data\\Trec2005.txt");
-//    load_emails(emails, "C:\\Users\\alexa\\Documents\\KUL\\BigData\\Assignment1\\Assignment1_BigData\\data\\Trec2006.txt");
-//    load_emails(emails, "C:\\Users\\alexa\\Documents\\KUL\\BigData\\Assignment1\\Assignment1_BigData\\data\\Trec2007.txt");
+//    return {
+//        "C:\\Users\\alexa\\Documents\\KUL\\BigData\\Assignment1\\Assignment1_BigData\\data\\Enron.txt",
+//        "C:\\Users\\alexa\\Documents\\KUL\\BigData\\Assignment1\\Assignment1_BigData\\data\\SpamAssasin.txt",
+//        "C:\\Users\\alexa\\Documents\\KUL\\BigData\\Assignment1\\Assignment1_BigData\\data\\Trec2005.txt",
+//        "C:\\Users\\alexa\\Documents\\KUL\\BigData\\Assignment1\\Assignment1_BigData\\data\\Trec2006.txt",
+//        "C:\\Users\\alexa\\Documents\\KUL\\BigData\\Assignment1\\Assignment1_BigData\\data\\Trec2007.txt"};
 
    // Remote Linux
-   load_emails(emails, "/home/r0673385/Documents/BigData/Assignment1/Assignment1_BigData/data/Enron.txt");
-   load_emails(emails, "/home/r0673385/Documents/BigData/Assignment1/Assignment1_BigData/data/SpamAssasin.txt");
-   load_emails(emails, "/home/r0673385/Documents/BigData/Assignment1/Assignment1_BigData/data/Trec2005.txt");
-   load_emails(emails, "/home/r0673385/Documents/BigData/Assignment1/Assignment1_BigData/data/Trec2006.txt");
-   load_emails(emails, "/home/r0673385/Documents/BigData/Assignment1/Assignment1_BigData/data/Trec2007.txt");
+   return {
+       "/home/r0673385/Documents/BigData/Assignment1/Assignment1_BigData/data/Enron.txt",
+       "/home/r0673385/Documents/BigData/Assignment1/Assignment1_BigData/data/SpamAssasin.txt",
+       "/home/r0673385/Documents/BigData/Assignment1/Assignment1_BigData/data/Trec2005.txt",
+       "/home/r0673385/Documents/BigData/Assignment1/Assignment1_BigData/data/Trec2006.txt",
+       "/home/r0673385/Documents/BigData/Assignment1/Assignment1_BigData/data/Trec2007.txt"};
+}
+
+std::vector<Email> load_emails(int seed)
+{
+    std::vector<Email> emails;
+    load_emails(emails, corpus_files());
 
     // Shuffle the emails
     std::default_random_engine g(seed);
@@ -72,116 +149,467 @@ std::vector<Email> load_emails(int seed)
     return emails;
 }
 
-/**
- * This function emulates a stream of emails. Every `window` examples, the
- * metric is evaluated and the score is recorded. Use the results of this
- * function to plot your learning curves.
- */
-template <typename Clf, typename Metric>
-std::tuple<std::vector<double>,std::vector<double>,std::vector<double>>
-stream_emails(const std::vector<Email> &emails,
-              Clf& clf, Metric& metric, int window)
+/** Parse a comma separated list of values, e.g. `1,5,10`. */
+template <typename T>
+std::vector<T> parse_list(const std::string& arg)
+{
+    std::vector<T> out;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        std::stringstream is(item);
+        T value;
+        if (!(is >> value))
+            throw std::invalid_argument("invalid value `" + item + "`");
+        out.push_back(value);
+    }
+    return out;
+}
+
+int sweep_usage()
+{
+    std::cerr << "Usage: ./bdap_assignment1 sweep <output-csv> [options]\n"
+              << "Options take comma separated lists of values:\n"
+              << "  --clf nb-hashing,nb-countmin,perceptron-hashing,perceptron-countmin\n"
+              << "  --mode windowed,prequential\n"
+              << "  --window 100\n"
+              << "  --ngram 3\n"
+              << "  --log-buckets 17\n"
+              << "  --num-hashes 3\n"
+              << "  --threshold 0.5 (all evaluated in the same run)\n"
+              << "  --learning-rate 0.8\n"
+              << "  --counter int32,int16,int8,morris8\n"
+              << "  --weights double,float,int16\n"
+              << "  --conservative 0,1\n"
+              << "  --threads <number of threads>"
+              << std::endl;
+    return 1;
+}
+
+/** Whether the tables of `c` can be allocated and indexed: perceptron
+ * weight tables are indexed with 32-bit signed indices (see
+ * `check_bucket_index_range`), and 2^32 buckets per class is already 32 GB
+ * of Naive Bayes counters. */
+bool valid_table_size(const SweepConfig& c)
+{
+    bool perceptron = c.clf == "perceptron-hashing" || c.clf == "perceptron-countmin";
+    int max_log_num_buckets = perceptron ? 31 : 32;
+    if (c.log_num_buckets < 1 || c.log_num_buckets > max_log_num_buckets)
+        return false;
+    if (c.clf == "perceptron-countmin"
+            && static_cast<size_t>(c.num_hashes) > (size_t{1} << (31 - c.log_num_buckets)))
+        return false;
+    return true;
+}
+
+/** Whether every perceptron update of `c` is representable in its weight
+ * type (see `check_learning_rate`). */
+bool valid_learning_rate(const SweepConfig& c)
 {
-    std::vector<double> accuracy;
-    std::vector<double> precision;
-    std::vector<double> recall;
-    for (size_t i = 0; i < emails.size(); i+=window)
+    if (c.weights.empty())
+        return true;
+    double resolution = c.weights == "int16" ? Fixed16Weight::resolution : 0.0;
+    return c.learning_rate > 0.0 && 2.0 * c.learning_rate >= resolution;
+}
+
+/** Run all configurations of a hyperparameter grid on one in-memory copy of
+ * the corpus, and write their learning curves to a single CSV file. */
+int sweep_main(int argc, char *argv[])
+{
+    if (argc < 3 || argc % 2 != 1)
+        return sweep_usage();
+
+    std::string outfname{argv[2]};
+    SweepGrid grid;
+    size_t num_threads = default_num_threads();
+    try
+    {
+        for (int i = 3; i < argc; i += 2)
+        {
+            std::string opt{argv[i]};
+            std::string val{argv[i+1]};
+            if (opt == "--clf") grid.clfs = parse_list<std::string>(val);
+            else if (opt == "--mode") grid.modes = parse_list<std::string>(val);
+            else if (opt == "--window") grid.windows = parse_list<int>(val);
+            else if (opt == "--ngram") grid.ngram_ks = parse_list<int>(val);
+            else if (opt == "--log-buckets") grid.log_num_buckets = parse_list<int>(val);
+            else if (opt == "--num-hashes") grid.num_hashes = parse_list<int>(val);
+            else if (opt == "--threshold") grid.thresholds = parse_list<double>(val);
+            else if (opt == "--learning-rate") grid.learning_rates = parse_list<double>(val);
+            else if (opt == "--counter") grid.counters = parse_list<std::string>(val);
+            else if (opt == "--weights") grid.weights = parse_list<std::string>(val);
+            else if (opt == "--conservative") grid.conservative = parse_list<int>(val);
+            else if (opt == "--threads") num_threads = parse_list<size_t>(val).at(0);
+            else return sweep_usage();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return sweep_usage();
+    }
+
+    std::vector<SweepConfig> configs = grid.configs();
+    for (const SweepConfig& c : configs)
+    {
+        if (std::find(SWEEP_CLASSIFIERS.begin(), SWEEP_CLASSIFIERS.end(), c.clf) == SWEEP_CLASSIFIERS.end()
+                || std::find(SWEEP_MODES.begin(), SWEEP_MODES.end(), c.mode) == SWEEP_MODES.end()
+                || c.window <= 0 || c.ngram_k <= 0 || c.num_hashes <= 0 || c.thresholds.empty()
+                || (!c.counter.empty()
+                    && std::find(SWEEP_COUNTERS.begin(), SWEEP_COUNTERS.end(), c.counter) == SWEEP_COUNTERS.end())
+                || (!c.weights.empty()
+                    && std::find(SWEEP_WEIGHTS.begin(), SWEEP_WEIGHTS.end(), c.weights) == SWEEP_WEIGHTS.end())
+                || !valid_table_size(c) || !valid_learning_rate(c))
+        {
+            std::cerr << "Invalid configuration for " << c.clf << std::endl;
+            return 2;
+        }
+    }
+
+    std::ofstream out(outfname);
+    if (!out.is_open())
     {
-        for (size_t u = 0; u < window && i+u < emails.size(); ++u)
-            metric.evaluate(clf, emails[i+u]);
+        std::cerr << "Failed to open output file `" << outfname << "`" << std::endl;
+        return 3;
+    }
 
-        accuracy.push_back(metric.get_score());
-        precision.push_back(metric.get_precision());
-        recall.push_back(metric.get_recall());
+    int seed = 12;
+    std::vector<Email> emails = load_emails(seed);
+    std::cout << "#emails: " << emails.size() << std::endl;
 
-        for (size_t u = 0; u < window && i+u < emails.size(); ++u)
-            clf.update(emails[i+u]);
+    steady_clock::time_point begin = steady_clock::now();
+    std::vector<SweepResult> results;
+    try
+    {
+        results = run_sweep(emails, configs, num_threads);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Sweep failed: " << e.what() << std::endl;
+        return 4;
     }
-    return std::make_tuple(accuracy,precision,recall);
+    steady_clock::time_point end = steady_clock::now();
+
+    write_sweep_csv(out, results);
+    std::cout << "Ran " << configs.size() << " configurations on " << num_threads
+              << " threads in " << (duration_cast<milliseconds>(end-begin).count()/1000.0)
+              << "s" << std::endl;
+    print_profile(std::cout);
+    return 0;
 }
 
-int main(int argc, char *argv[])
+int train_usage()
 {
-    if (argc != 4)
+    std::cerr << "Usage: ./bdap_assignment1 train-parallel [options]\n"
+              << "  --threads 1,2,4,8  (1 is the serial baseline)\n"
+              << "  --log-buckets 17\n"
+              << "  --merge-every <emails>  (Naive Bayes, 0 merges once at the end)\n"
+              << "  --save-model <dir>  (write a snapshot of every trained model to <dir>)\n"
+              << "  --load-model <dir>  (test the snapshots in <dir> instead of training)"
+              << std::endl;
+    return 1;
+}
+
+/** Where `train-parallel` saves its models to or loads them from, see
+ * `save_snapshot`. Empty for neither. */
+struct ModelDirs
+{
+    std::string save;
+    std::string load;
+};
+
+/** Train a fresh classifier from `make_clf()` on `train` with `train_fn`
+ * once per thread count, and report its throughput and its accuracy on
+ * `test`. The model of the last thread count is saved as `file` in
+ * `dirs.save`. With `dirs.load`, the model is loaded from there instead and
+ * only tested. */
+template <typename MakeClf, typename TrainFn>
+void run_parallel_training(const char *name, const std::string& file, MakeClf make_clf,
+                           TrainFn train_fn, const std::vector<Email>& train,
+                           const std::vector<Email>& test, const std::vector<size_t>& num_threads,
+                           const ModelDirs& dirs)
+{
+    using Clf = decltype(make_clf());
+    if (!dirs.load.empty())
     {
-        std::cerr << "Usage: ./bdap_assignment1 <window-size> <ngram_k> <output-file>"
+        std::string fname = dirs.load + "/" + file;
+        Clf clf = load_snapshot<Clf>(fname);
+        std::vector<HashedEmail> test_hashed;
+        for (const Email& email : test)
+            test_hashed.push_back(clf.hash_email(email));
+        Accuracy metric;
+        metric.evaluate(clf, test_hashed);
+        std::cout << name << ": loaded " << fname << ", test accuracy " << metric.get_accuracy()
                   << std::endl;
-        return 1;
+        return;
     }
 
-    int window = std::atoi(argv[1]);
-    int ngram_k = std::atoi(argv[2]);
-    std::string outfname{argv[3]};
+    Clf clf = make_clf();
+    std::vector<HashedEmail> train_hashed, test_hashed;
+    for (const Email& email : train)
+        train_hashed.push_back(clf.hash_email(email));
+    for (const Email& email : test)
+        test_hashed.push_back(clf.hash_email(email));
 
-    if (window <= 0)
+    double serial_rate = 0.0;
+    for (size_t threads : num_threads)
     {
-        std::cerr << "Invalid window size " << window << std::endl;
-        return 2;
+        clf = make_clf();
+        TrainingStats stats = train_fn(clf, train_hashed, threads);
+        Accuracy metric;
+        metric.evaluate(clf, test_hashed);
+        if (stats.num_threads == 1)
+            serial_rate = stats.emails_per_second();
+
+        std::cout << name << ": " << stats.num_threads << " threads, "
+                  << stats.emails_per_second() << " emails/s";
+        if (serial_rate > 0.0)
+            std::cout << " (" << stats.emails_per_second() / serial_rate << "x serial)";
+        std::cout << ", test accuracy " << metric.get_accuracy() << std::endl;
     }
 
-    if (ngram_k <= 0)
+    if (!dirs.save.empty())
     {
-        std::cerr << "Invalid ngram_k value " << ngram_k << std::endl;
-        return 3;
+        std::string fname = dirs.save + "/" + file;
+        save_snapshot(fname, clf);
+        std::cout << name << ": saved " << fname << std::endl;
+    }
+}
+
+/** Compare serial training with Hogwild training of the perceptrons and
+ * sharded training of the Naive Bayes models: train on the first 80% of
+ * the corpus, test on the rest. */
+int train_main(int argc, char *argv[])
+{
+    if (argc % 2 != 0)
+        return train_usage();
+
+    std::vector<size_t> num_threads = {1, default_num_threads()};
+    int log_num_buckets = 17;
+    size_t merge_every = 0;
+    ModelDirs dirs;
+    try
+    {
+        for (int i = 2; i < argc; i += 2)
+        {
+            std::string opt{argv[i]};
+            std::string val{argv[i+1]};
+            if (opt == "--threads") num_threads = parse_list<size_t>(val);
+            else if (opt == "--save-model") dirs.save = val;
+            else if (opt == "--load-model") dirs.load = val;
+            else if (opt == "--log-buckets") log_num_buckets = parse_list<int>(val).at(0);
+            else if (opt == "--merge-every") merge_every = parse_list<size_t>(val).at(0);
+            else return train_usage();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return train_usage();
     }
+    // the perceptron Count-Min model has 3 rows of 32-bit indexed weights
+    if (log_num_buckets < 1 || log_num_buckets > 29)
+        return train_usage();
+
+    // the serial baseline first, for the speedups
+    if (std::find(num_threads.begin(), num_threads.end(), 1) == num_threads.end())
+        num_threads.insert(num_threads.begin(), 1);
+    else
+        std::stable_partition(num_threads.begin(), num_threads.end(), [](size_t t) { return t == 1; });
 
     int seed = 12;
     std::vector<Email> emails = load_emails(seed);
     std::cout << "#emails: " << emails.size() << std::endl;
+    size_t num_train = emails.size() * 8 / 10;
+    std::vector<Email> test(emails.begin() + num_train, emails.end());
+    emails.erase(emails.begin() + num_train, emails.end());
+
+    auto hogwild = [](auto& clf, const std::vector<HashedEmail>& train, size_t threads) {
+        return train_hogwild(clf, train, threads);
+    };
+    auto sharded = [&](auto& clf, const std::vector<HashedEmail>& train, size_t threads) {
+        return train_sharded(clf, train, threads, merge_every);
+    };
+
+    try
+    {
+        run_parallel_training("Bayes Hashing", "bayes-hashing.bdap", [&]() {
+            NaiveBayesFeatureHashing clf{log_num_buckets, 0.5, BucketLayout::interleaved};
+            clf.compositional_ngrams = true;
+            return clf;
+        }, sharded, emails, test, num_threads, dirs);
+        run_parallel_training("Bayes CountMin", "bayes-countmin.bdap", [&]() {
+            NaiveBayesCountMin<Counter32, 3> clf{3, log_num_buckets, 0.5, true, BucketLayout::interleaved};
+            clf.compositional_ngrams = true;
+            return clf;
+        }, sharded, emails, test, num_threads, dirs);
+        run_parallel_training("Perceptron Hashing", "perceptron-hashing.bdap", [&]() {
+            PerceptronFeatureHashing clf{log_num_buckets, 0.8};
+            clf.compositional_ngrams = true;
+            return clf;
+        }, hogwild, emails, test, num_threads, dirs);
+        run_parallel_training("Perceptron CountMin", "perceptron-countmin.bdap", [&]() {
+            PerceptronCountMin<DoubleWeight, 3> clf{3, log_num_buckets, 0.8, true};
+            clf.compositional_ngrams = true;
+            return clf;
+        }, hogwild, emails, test, num_threads, dirs);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 3;
+    }
+    print_profile(std::cout);
+    return 0;
+}
 
-    Accuracy metric;
-    NaiveBayesFeatureHashing bh{17,0.5};
-    NaiveBayesCountMin bcm{3,17,0.5};
+/** Stream `emails`, a vector or an `EmailStream`, through all four
+ * classifiers and print their final scores. */
+template <typename Emails>
+void run_models(Emails& emails)
+{
+    Accuracy bh_metric, bcm_metric, ph_metric, pcm_metric;
+    NaiveBayesFeatureHashing bh{17,0.5,BucketLayout::interleaved};
+    NaiveBayesCountMin<Counter32, 3> bcm{3,17,0.5,true,BucketLayout::interleaved};
     PerceptronFeatureHashing ph{17, 0.8};
-    PerceptronCountMin pcm{3,17,0.8};
+    PerceptronCountMin<DoubleWeight, 3> pcm{3,17,0.8,true};
     bh.ngram_k = 3;
     bcm.ngram_k = 3;
     ph.ngram_k = 3;
     pcm.ngram_k =3;
+    bh.compositional_ngrams = true;
+    bcm.compositional_ngrams = true;
+    ph.compositional_ngrams = true;
+    pcm.compositional_ngrams = true;
+    // all four hash like the Count-Min models, so each email is hashed once
+    bh.use_count_min_hashing();
+    ph.use_count_min_hashing();
 
+    // all four classifiers in a single pass over the stream, scoring the
+    // emails of each window in parallel
+    ThreadPool pool(default_num_threads());
     steady_clock::time_point begin = steady_clock::now();
-    auto [accuracy,precision,recall] = stream_emails(emails, bh, metric, 100);
+    auto curves = stream_emails(emails, 100, pool,
+                                stream_model(bh, bh_metric),
+                                stream_model(bcm, bcm_metric),
+                                stream_model(ph, ph_metric),
+                                stream_model(pcm, pcm_metric));
     steady_clock::time_point end = steady_clock::now();
-
-    std::cout << "------- Bayes Hashing ------- " << std::endl;
     std::cout << (duration_cast<milliseconds>(end-begin).count()/1000.0) << "s" << std::endl;
-    std::cout << "Accuracy: " <<  accuracy[accuracy.size()-1] << std::endl;
-    std::cout << "Precision: " << precision[precision.size()-1] << std::endl;
-    std::cout << "Recall: " << recall[recall.size()-1] << std::endl;
     std::cout << std::endl;
 
-    begin = steady_clock::now();
-    auto [accuracy1,precision1,recall1] = stream_emails(emails, bcm, metric, 100);
-    end = steady_clock::now();
+    const char *names[] = {"Bayes Hashing", "Bayes CountMin", "Peceptron Hashing", "Perceptron CountMin"};
+    for (size_t i = 0; i < curves.size(); ++i)
+    {
+        auto& [accuracy,precision,recall] = curves[i];
+        std::cout << "------- " << names[i] << " ------- " << std::endl;
+        std::cout << "Accuracy: " <<  accuracy[accuracy.size()-1] << std::endl;
+        std::cout << "Precision: " << precision[precision.size()-1] << std::endl;
+        std::cout << "Recall: " << recall[recall.size()-1] << std::endl;
+        std::cout << std::endl;
+    }
 
-    std::cout << "------- Bayes CountMin ------- " << std::endl;
-    std::cout << (duration_cast<milliseconds>(end-begin).count()/1000.0) << "s" << std::endl;
-    std::cout << "Accuracy: " <<  accuracy1[accuracy1.size()-1] << std::endl;
-    std::cout << "Precision: " << precision1[precision1.size()-1] << std::endl;
-    std::cout << "Recall: " << recall1[recall1.size()-1] << std::endl;
-    std::cout << std::endl;
+    // how many counts the Naive Bayes sketches lost to saturated counters
+    std::cout << "Saturated increments: " << names[0] << " " << bh.num_saturated() << "/"
+              << bh.num_increments() << ", " << names[1] << " " << bcm.num_saturated() << "/"
+              << bcm.num_increments() << std::endl;
 
-    begin = steady_clock::now();
-    auto [accuracy2,precision2,recall2] = stream_emails(emails, ph, metric, 100);
-    end = steady_clock::now();
+    print_profile(std::cout);
+}
 
-    std::cout << "------- Peceptron Hashing ------- " << std::endl;
-    std::cout << (duration_cast<milliseconds>(end-begin).count()/1000.0) << "s" << std::endl;
-    std::cout << "Accuracy: " <<  accuracy2[accuracy2.size()-1] << std::endl;
-    std::cout << "Precision: " << precision2[precision2.size()-1] << std::endl;
-    std::cout << "Recall: " << recall2[recall2.size()-1] << std::endl;
-    std::cout << std::endl;
+int stream_usage()
+{
+    std::cerr << "Usage: ./bdap_assignment1 stream [options]\n"
+              << "  --buffer 10000  (emails in the shuffle buffer, 0 keeps the file order)\n"
+              << "  --block-mb 4    (size of the blocks the corpus files are read in)"
+              << std::endl;
+    return 1;
+}
 
-    begin = steady_clock::now();
-    auto [accuracy3,precision3,recall3] = stream_emails(emails, pcm, metric, 100);
-    end = steady_clock::now();
+/** Like the default mode, but the corpus is read as it is streamed instead
+ * of being loaded up front, so memory stays bounded however large it is. */
+int stream_main(int argc, char *argv[])
+{
+    if (argc % 2 != 0)
+        return stream_usage();
+
+    size_t buffer_size = 10000;
+    size_t block_mb = 4;
+    try
+    {
+        for (int i = 2; i < argc; i += 2)
+        {
+            std::string opt{argv[i]};
+            std::string val{argv[i+1]};
+            if (opt == "--buffer") buffer_size = parse_list<size_t>(val).at(0);
+            else if (opt == "--block-mb") block_mb = parse_list<size_t>(val).at(0);
+            else return stream_usage();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return stream_usage();
+    }
+    if (block_mb == 0)
+        return stream_usage();
+
+    int seed = 12;
+    EmailStream emails(corpus_files(), buffer_size, seed, block_mb * 1024 * 1024);
+    try
+    {
+        run_models(emails);
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 2 && std::string(argv[1]) == "sweep")
+        return sweep_main(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "train-parallel")
+        return train_main(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "stream")
+        return stream_main(argc, argv);
+
+    if (argc != 4)
+    {
+        std::cerr << "Usage: ./bdap_assignment1 <window-size> <ngram_k> <output-file>\n"
+                  << "       ./bdap_assignment1 sweep <output-csv> [options]\n"
+                  << "       ./bdap_assignment1 train-parallel [options]\n"
+                  << "       ./bdap_assignment1 stream [options]"
+                  << std::endl;
+        return 1;
+    }
+
+    int window = std::atoi(argv[1]);
+    int ngram_k = std::atoi(argv[2]);
+    std::string outfname{argv[3]};
+
+    if (window <= 0)
+    {
+        std::cerr << "Invalid window size " << window << std::endl;
+        return 2;
+    }
+
+    if (ngram_k <= 0)
+    {
+        std::cerr << "Invalid ngram_k value " << ngram_k << std::endl;
+        return 3;
+    }
+
+    int seed = 12;
+    std::vector<Email> emails = load_emails(seed);
+    std::cout << "#emails: " << emails.size() << std::endl;
+
+    run_models(emails);
 
-    std::cout << "------- Perceptron CountMin ------- " << std::endl;
-    std::cout << (duration_cast<milliseconds>(end-begin).count()/1000.0) << "s" << std::endl;
-    std::cout << "Accuracy: " <<  accuracy3[accuracy3.size()-1] << std::endl;
-    std::cout << "Precision: " << precision3[precision3.size()-1] << std::endl;
-    std::cout << "Recall: " << recall3[recall3.size()-1] << std::endl;
-    std::cout << std::endl;
     // write out the results
 //    std::ofstream bh_acc{"bh_acc"};
 //    std::ofstream bh_prec{"bh_prec"};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#if defined(_WIN32)
+#include <fstream>
+#include <sstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace bdap {
+
+/**
+ * A read-only view of a whole file. On POSIX systems the file is mapped
+ * into memory with `mmap`, so its bytes are only paged in when they are
+ * accessed and are never copied. Elsewhere, the file is read into memory.
+ *
+ * With `copy_on_write`, the bytes can also be written through
+ * `mutable_data`. Written pages are private copies; the file itself never
+ * changes.
+ *
+ * Throws `std::runtime_error` if the file cannot be opened.
+ */
+class MappedFile {
+    char *data_ = nullptr;
+    size_t size_ = 0;
+#if defined(_WIN32)
+    std::string contents_;
+#endif
+
+public:
+    enum Mode { read_only, copy_on_write };
+
+    explicit MappedFile(const std::string& fname, Mode mode = read_only)
+    {
+#if defined(_WIN32)
+        std::ifstream f(fname, std::ios::binary);
+        if (!f.is_open())
+            throw std::runtime_error("cannot open " + fname);
+        std::stringstream buf;
+        buf << f.rdbuf();
+        contents_ = buf.str();
+        data_ = &contents_[0];
+        size_ = contents_.size();
+#else
+        int fd = ::open(fname.c_str(), O_RDONLY);
+        if (fd == -1)
+            throw std::runtime_error("cannot open " + fname);
+
+        struct stat st;
+        if (::fstat(fd, &st) == -1)
+        {
+            ::close(fd);
+            throw std::runtime_error("cannot stat " + fname);
+        }
+
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0)
+        {
+            int prot = mode == copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ;
+            void *p = ::mmap(nullptr, size_, prot, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                ::close(fd);
+                throw std::runtime_error("cannot mmap " + fname);
+            }
+            if (mode == read_only)
+                ::madvise(p, size_, MADV_SEQUENTIAL);
+            data_ = static_cast<char *>(p);
+        }
+        ::close(fd); // the mapping stays valid
+#endif
+    }
+
+    ~MappedFile()
+    {
+#if !defined(_WIN32)
+        if (data_ != nullptr)
+            ::munmap(data_, size_);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view view() const { return {data_, size_}; }
+    const char *data() const { return data_; }
+    /** Only writable in `copy_on_write` mode. */
+    char *mutable_data() const { return data_; }
+    size_t size() const { return size_; }
+};
+
+} // namespace bdap
@@ -1,3 +1,12 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
 #include "email.hpp"
 
 namespace bdap {
@@ -10,18 +19,29 @@ struct Accuracy
     int TP = 0;
     int FN = 0;
 
-    template<typename Clf>
-    void evaluate(const Clf &clf, const std::vector<Email> &emails)
+    template<typename Clf, typename E>
+    void evaluate(const Clf &clf, const std::vector<E> &emails)
     {
-        for (const Email &email: emails)
-            evaluate(clf, email);
+        std::vector<double> scores(emails.size());
+        clf.predict_batch(emails, scores);
+        for (size_t i = 0; i < emails.size(); ++i)
+            record(clf, emails[i].is_spam(), scores[i]);
     }
 
+    template<typename Clf, typename E>
+    void evaluate(const Clf &clf, const E &email)
+    { record(clf, email.is_spam(), clf.predict(email)); }
+
+    /** Prequential evaluation: count the prediction of `clf` for `email`,
+     * then train `clf` on it. */
+    template<typename Clf, typename E>
+    void evaluate_and_learn(Clf &clf, const E &email)
+    { record(clf, email.is_spam(), clf.learn_one(email)); }
+
+    /** Count an email with label `lab` for which `clf` predicted `pr`. */
     template<typename Clf>
-    void evaluate(const Clf &clf, const Email &email)
+    void record(const Clf &clf, bool lab, double pr)
     {
-        bool lab = email.is_spam();
-        double pr = clf.predict(email);
         bool pred = clf.classify(pr);
         ++n;
         correct += static_cast<int>(lab == pred);
@@ -30,6 +50,19 @@ struct Accuracy
         FN += static_cast<int>((lab && !pred));
     }
 
+    /** Add the counts of `o`, e.g. a partial metric of another thread. */
+    void merge(const Accuracy &o)
+    {
+        n += o.n;
+        correct += o.correct;
+        FP += o.FP;
+        TP += o.TP;
+        FN += o.FN;
+    }
+
+    void reset()
+    { *this = Accuracy{}; }
+
     double get_accuracy() const
     { return static_cast<double>(correct) / n; }
 
@@ -51,23 +84,43 @@ struct Precision
     int FP = 0;
     int TP = 0;
 
-    template<typename Clf>
-    void evaluate(const Clf &clf, const std::vector<Email> &emails)
+    template<typename Clf, typename E>
+    void evaluate(const Clf &clf, const std::vector<E> &emails)
     {
-        for (const Email &email: emails)
-            evaluate(clf, email);
+        std::vector<double> scores(emails.size());
+        clf.predict_batch(emails, scores);
+        for (size_t i = 0; i < emails.size(); ++i)
+            record(clf, emails[i].is_spam(), scores[i]);
     }
 
+    template<typename Clf, typename E>
+    void evaluate(const Clf &clf, const E &email)
+    { record(clf, email.is_spam(), clf.predict(email)); }
+
+    /** Prequential evaluation: count the prediction of `clf` for `email`,
+     * then train `clf` on it. */
+    template<typename Clf, typename E>
+    void evaluate_and_learn(Clf &clf, const E &email)
+    { record(clf, email.is_spam(), clf.learn_one(email)); }
+
+    /** Count an email with label `lab` for which `clf` predicted `pr`. */
     template<typename Clf>
-    void evaluate(const Clf &clf, const Email &email)
+    void record(const Clf &clf, bool lab, double pr)
     {
-        bool lab = email.is_spam();
-        double pr = clf.predict(email);
         bool pred = clf.classify(pr);
         TP += static_cast<int>((lab && pred));
         FP += static_cast<int>((!lab && pred));
     }
 
+    void merge(const Precision &o)
+    {
+        FP += o.FP;
+        TP += o.TP;
+    }
+
+    void reset()
+    { *this = Precision{}; }
+
     double get_precision() const
     { return static_cast<double>(TP) / (TP + FP); }
 
@@ -80,23 +133,43 @@ struct Recall
     int FN = 0;
     int TP = 0;
 
-    template<typename Clf>
-    void evaluate(const Clf &clf, const std::vector<Email> &emails)
+    template<typename Clf, typename E>
+    void evaluate(const Clf &clf, const std::vector<E> &emails)
     {
-        for (const Email &email: emails)
-            evaluate(clf, email);
+        std::vector<double> scores(emails.size());
+        clf.predict_batch(emails, scores);
+        for (size_t i = 0; i < emails.size(); ++i)
+            record(clf, emails[i].is_spam(), scores[i]);
     }
 
+    template<typename Clf, typename E>
+    void evaluate(const Clf &clf, const E &email)
+    { record(clf, email.is_spam(), clf.predict(email)); }
+
+    /** Prequential evaluation: count the prediction of `clf` for `email`,
+     * then train `clf` on it. */
+    template<typename Clf, typename E>
+    void evaluate_and_learn(Clf &clf, const E &email)
+    { record(clf, email.is_spam(), clf.learn_one(email)); }
+
+    /** Count an email with label `lab` for which `clf` predicted `pr`. */
     template<typename Clf>
-    void evaluate(const Clf &clf, const Email &email)
+    void record(const Clf &clf, bool lab, double pr)
     {
-        bool lab = email.is_spam();
-        double pr = clf.predict(email);
         bool pred = clf.classify(pr);
         TP += static_cast<int>((lab && pred));
         FN += static_cast<int>((lab && !pred));
     }
 
+    void merge(const Recall &o)
+    {
+        FN += o.FN;
+        TP += o.TP;
+    }
+
+    void reset()
+    { *this = Recall{}; }
+
     double get_recall() const
     { return static_cast<double>(TP) / (TP + FN); }
 
@@ -111,25 +184,454 @@ struct ConfusionMatrix
     int TP = 0;
     int FN = 0;
 
-    template<typename Clf>
-    void evaluate(const Clf &clf, const std::vector<Email> &emails)
+    template<typename Clf, typename E>
+    void evaluate(const Clf &clf, const std::vector<E> &emails)
     {
-        for (const Email &email: emails)
-            evaluate(clf, email);
+        std::vector<double> scores(emails.size());
+        clf.predict_batch(emails, scores);
+        for (size_t i = 0; i < emails.size(); ++i)
+            record(clf, emails[i].is_spam(), scores[i]);
     }
 
+    template<typename Clf, typename E>
+    void evaluate(const Clf &clf, const E &email)
+    { record(clf, email.is_spam(), clf.predict(email)); }
+
+    /** Prequential evaluation: count the prediction of `clf` for `email`,
+     * then train `clf` on it. */
+    template<typename Clf, typename E>
+    void evaluate_and_learn(Clf &clf, const E &email)
+    { record(clf, email.is_spam(), clf.learn_one(email)); }
+
+    /** Count an email with label `lab` for which `clf` predicted `pr`. */
     template<typename Clf>
-    void evaluate(const Clf &clf, Email &emails)
+    void record(const Clf &clf, bool lab, double pr)
     {
-        bool lab = emails.is_spam();
-        double pr = clf.predict(emails);
         bool pred = clf.classify(pr);
         TP += static_cast<int>((lab && pred));
         FP += static_cast<int>((!lab && pred));
         FN += static_cast<int>((lab && !pred));
         TN += static_cast<int>((!lab && !pred));
     }
+
+    void merge(const ConfusionMatrix &o)
+    {
+        TN += o.TN;
+        FP += o.FP;
+        TP += o.TP;
+        FN += o.FN;
+    }
+
+    void reset()
+    { *this = ConfusionMatrix{}; }
+};
+
+/** A point of a ROC curve: the rates at which spam and ham score above
+ * `threshold`, and the precision there. */
+struct RocPoint
+{
+    double threshold;
+    double fpr;
+    double tpr; // = recall
+    double precision;
 };
 
+/** How a `ScoreHistogram` maps scores to its bins. */
+enum class ScoreScale
+{
+    linear,     // the score itself
+    log_odds,   // log(p / (1 - p)) of a probability, e.g. a Naive Bayes posterior
+    signed_log, // sign(x) log(1 + |x|), e.g. a perceptron margin
+};
+
+/**
+ * Histograms of the `predict` scores of spam and of ham, from which the ROC
+ * curve, the AUC, and the precision and recall at any threshold follow
+ * without a second pass over the stream. Memory is fixed by `num_bins`.
+ *
+ * The bins split [`lo`, `hi`] evenly after the scores are mapped by `scale`;
+ * scores outside it are counted in the first or last bin, so the range
+ * should cover the scores of the classifier. Use `for_probabilities` for the
+ * Naive Bayes posteriors, which pile up near 0 and 1, and `for_margins` for
+ * the perceptrons. A bin holds the scores above its lower edge up to and
+ * including its upper edge, and thresholds are rounded up to the next bin
+ * edge, so that a score equal to the threshold is not counted as spam, as in
+ * `classify`.
+ *
+ * `get_precision` and `get_recall` are at the threshold of the classifier
+ * whose scores were recorded last, and `get_score` is the AUC.
+ * `stream_emails` calls `end_window` after every window, which appends the
+ * AUC to `auc_curve()`.
+ */
+struct ScoreHistogram
+{
+    double lo;
+    double hi;
+    ScoreScale scale;
+    std::vector<uint64_t> spam; // number of spam emails per bin
+    std::vector<uint64_t> ham;  // number of ham emails per bin
+    double threshold = 0.0;
+
+    explicit ScoreHistogram(double lo = 0.0, double hi = 1.0, size_t num_bins = 1000,
+                            ScoreScale scale = ScoreScale::linear)
+        : lo(lo), hi(hi), scale(scale), spam(num_bins, 0), ham(num_bins, 0),
+          auc_curve_(std::make_shared<std::vector<double>>())
+    {
+        if (!(hi > lo) || num_bins == 0)
+            throw std::invalid_argument("score histogram needs lo < hi and at least one bin");
+    }
+
+    /** Bins for probabilities, by log-odds in [-40, 40]. A posterior rounds
+     * to 1 at a log-odds of about 37, so the spam side of the range is all
+     * that a double can tell apart. */
+    static ScoreHistogram for_probabilities(size_t num_bins = 1000)
+    { return ScoreHistogram(-40.0, 40.0, num_bins, ScoreScale::log_odds); }
+
+    /** Bins for margins around 0, by signed log in [-16, 16], i.e. margins
+     * up to about 9e6 in magnitude, at a resolution relative to the
+     * margin. */
+    static ScoreHistogram for_margins(size_t num_bins = 1000)
+    { return ScoreHistogram(-16.0, 16.0, num_bins, ScoreScale::signed_log); }
+
+    template<typename Clf, typename E>
+    void evaluate(const Clf &clf, const std::vector<E> &emails)
+    {
+        std::vector<double> scores(emails.size());
+        clf.predict_batch(emails, scores);
+        for (size_t i = 0; i < emails.size(); ++i)
+            record(clf, emails[i].is_spam(), scores[i]);
+    }
+
+    template<typename Clf, typename E>
+    void evaluate(const Clf &clf, const E &email)
+    { record(clf, email.is_spam(), clf.predict(email)); }
+
+    /** Prequential evaluation: count the prediction of `clf` for `email`,
+     * then train `clf` on it. */
+    template<typename Clf, typename E>
+    void evaluate_and_learn(Clf &clf, const E &email)
+    { record(clf, email.is_spam(), clf.learn_one(email)); }
+
+    /** Count an email with label `lab` for which `clf` predicted `pr`. */
+    template<typename Clf>
+    void record(const Clf &clf, bool lab, double pr)
+    {
+        threshold = clf.threshold;
+        ++(lab ? spam : ham)[bin(pr)];
+    }
+
+    /** Add the counts of `o`, which must have the same bins. */
+    void merge(const ScoreHistogram &o)
+    {
+        if (o.lo != lo || o.hi != hi || o.scale != scale || o.spam.size() != spam.size())
+            throw std::invalid_argument("cannot merge score histograms with different bins");
+        for (size_t i = 0; i < spam.size(); ++i)
+        {
+            spam[i] += o.spam[i];
+            ham[i] += o.ham[i];
+        }
+        threshold = o.threshold;
+    }
+
+    /** Forget all scores, but keep the bins and the AUC curve. */
+    void reset()
+    {
+        std::fill(spam.begin(), spam.end(), 0);
+        std::fill(ham.begin(), ham.end(), 0);
+    }
+
+    /** Append the current AUC to `auc_curve()`. */
+    void end_window()
+    { auc_curve_->push_back(get_auc()); }
+
+    const std::vector<double> &auc_curve() const
+    { return *auc_curve_; }
+
+    size_t num_bins() const { return spam.size(); }
+
+    /** The lower edge of bin `i`, and the upper edge of the last bin for
+     * `i == num_bins()`, as a score. */
+    double edge(size_t i) const
+    { return unscaled(lo + (hi - lo) * i / num_bins()); }
+
+    /** The area under the ROC curve: the probability that a random spam
+     * email scores higher than a random ham email, counting scores in the
+     * same bin as ties. */
+    double get_auc() const
+    {
+        double area = 0.0;
+        uint64_t spam_above = 0;
+        for (size_t i = num_bins(); i-- > 0; )
+        {
+            area += ham[i] * (spam_above + 0.5 * spam[i]);
+            spam_above += spam[i];
+        }
+        return area / (static_cast<double>(spam_above) * total(ham));
+    }
+
+    double get_score() const
+    { return get_auc(); }
+
+    double get_precision() const
+    { return precision_at(threshold); }
+
+    double get_recall() const
+    { return recall_at(threshold); }
+
+    double precision_at(double t) const
+    {
+        size_t k = first_bin_above(t);
+        double tp = total(spam, k);
+        return tp / (tp + total(ham, k));
+    }
+
+    double recall_at(double t) const
+    { return static_cast<double>(total(spam, first_bin_above(t))) / total(spam); }
+
+    double false_positive_rate_at(double t) const
+    { return static_cast<double>(total(ham, first_bin_above(t))) / total(ham); }
+
+    /** The ROC curve with a point at every bin edge, from the highest
+     * threshold to the lowest. */
+    std::vector<RocPoint> roc() const
+    {
+        double num_spam = total(spam);
+        double num_ham = total(ham);
+        std::vector<RocPoint> out;
+        uint64_t tp = 0, fp = 0;
+        for (size_t k = num_bins() + 1; k-- > 0; )
+        {
+            if (k < num_bins())
+            {
+                tp += spam[k];
+                fp += ham[k];
+            }
+            out.push_back({edge(k), fp / num_ham, tp / num_spam,
+                           static_cast<double>(tp) / (tp + fp)});
+        }
+        return out;
+    }
+
+private:
+    std::shared_ptr<std::vector<double>> auc_curve_;
+
+    double scaled(double score) const
+    {
+        switch (scale)
+        {
+        case ScoreScale::log_odds: return std::log(score) - std::log1p(-score);
+        case ScoreScale::signed_log: return std::copysign(std::log1p(std::fabs(score)), score);
+        default: return score;
+        }
+    }
+
+    double unscaled(double x) const
+    {
+        switch (scale)
+        {
+        case ScoreScale::log_odds: return 1.0 / (1.0 + std::exp(-x));
+        case ScoreScale::signed_log: return std::copysign(std::expm1(std::fabs(x)), x);
+        default: return x;
+        }
+    }
+
+    /** The position of `score` in units of bins from `lo`. */
+    double position(double score) const
+    { return (scaled(score) - lo) / (hi - lo) * num_bins(); }
+
+    size_t bin(double pr) const
+    {
+        double x = std::ceil(position(pr));
+        if (!(x > 1.0)) // also NaN
+            return 0;
+        if (x >= num_bins())
+            return num_bins() - 1;
+        return static_cast<size_t>(x) - 1;
+    }
+
+    /** The first bin whose scores are all above `t`. */
+    size_t first_bin_above(double t) const
+    {
+        double x = std::ceil(position(t));
+        if (!(x > 0.0))
+            return 0;
+        return x >= num_bins() ? num_bins() : static_cast<size_t>(x);
+    }
+
+    static uint64_t total(const std::vector<uint64_t> &counts, size_t from = 0)
+    {
+        uint64_t sum = 0;
+        for (size_t i = from; i < counts.size(); ++i)
+            sum += counts[i];
+        return sum;
+    }
+};
+/**
+ * Accuracy, precision and recall of every threshold of a
+ * `MultiThresholdAccuracy` after every window of a stream. The values of
+ * window `w` and threshold `i` are at `w * thresholds.size() + i`.
+ */
+struct ThresholdCurves
+{
+    std::vector<double> thresholds;
+    std::vector<double> accuracy;
+    std::vector<double> precision;
+    std::vector<double> recall;
+
+    size_t num_windows() const
+    { return thresholds.empty() ? 0 : accuracy.size() / thresholds.size(); }
+
+    /** Write the curves as a CSV table with a row per window and
+     * threshold. */
+    void write_csv(std::ostream &os) const
+    {
+        os << "step,threshold,accuracy,precision,recall\n";
+        for (size_t w = 0; w < num_windows(); ++w)
+        {
+            for (size_t i = 0; i < thresholds.size(); ++i)
+            {
+                write_csv_row(os, w, i);
+                os << '\n';
+            }
+        }
+    }
+
+    /** Write the values of window `w` and threshold `i` as the fields of a
+     * CSV row, without the line break, so that a caller can add columns. */
+    void write_csv_row(std::ostream &os, size_t w, size_t i) const
+    {
+        size_t j = w * thresholds.size() + i;
+        os << w << ',' << thresholds[i] << ',' << accuracy[j] << ','
+           << precision[j] << ',' << recall[j];
+    }
+};
+
+/**
+ * Like `Accuracy`, but for many thresholds at once, all applied to the same
+ * `predict` score, so that one pass over the stream evaluates every
+ * candidate threshold. The counts are kept per threshold in separate arrays,
+ * which `record` updates in one branch-free loop.
+ *
+ * `get_score`, `get_precision` and `get_recall` are those of the first
+ * threshold. `stream_emails` calls `end_window` after every window, which
+ * appends the values of all thresholds to `curves()`. The curves are shared
+ * between copies of the metric, such as the partial metrics of a window
+ * that is scored in parallel.
+ */
+struct MultiThresholdAccuracy
+{
+    std::vector<double> thresholds;
+    int n = 0;
+    std::vector<int> correct;
+    std::vector<int> TP;
+    std::vector<int> FP;
+    std::vector<int> FN;
+
+    explicit MultiThresholdAccuracy(std::vector<double> thresholds)
+        : thresholds(std::move(thresholds)), correct(this->thresholds.size(), 0),
+          TP(this->thresholds.size(), 0), FP(this->thresholds.size(), 0),
+          FN(this->thresholds.size(), 0), curves_(std::make_shared<ThresholdCurves>())
+    {
+        if (this->thresholds.empty())
+            throw std::invalid_argument("need at least one threshold");
+        curves_->thresholds = this->thresholds;
+    }
+
+    template<typename Clf, typename E>
+    void evaluate(const Clf &clf, const std::vector<E> &emails)
+    {
+        std::vector<double> scores(emails.size());
+        clf.predict_batch(emails, scores);
+        for (size_t i = 0; i < emails.size(); ++i)
+            record(clf, emails[i].is_spam(), scores[i]);
+    }
+
+    template<typename Clf, typename E>
+    void evaluate(const Clf &clf, const E &email)
+    { record(clf, email.is_spam(), clf.predict(email)); }
+
+    /** Prequential evaluation: count the prediction of `clf` for `email`,
+     * then train `clf` on it. */
+    template<typename Clf, typename E>
+    void evaluate_and_learn(Clf &clf, const E &email)
+    { record(clf, email.is_spam(), clf.learn_one(email)); }
+
+    /** Count an email with label `lab` for which `clf` predicted `pr`, at
+     * every threshold. */
+    template<typename Clf>
+    void record(const Clf &, bool lab, double pr)
+    {
+        ++n;
+        int l = lab;
+        for (size_t i = 0; i < thresholds.size(); ++i)
+        {
+            int pred = pr > thresholds[i];
+            correct[i] += static_cast<int>(l == pred);
+            TP[i] += l & pred;
+            FP[i] += (1 - l) & pred;
+            FN[i] += l & (1 - pred);
+        }
+    }
+
+    /** Add the counts of `o`, which must have the same thresholds. */
+    void merge(const MultiThresholdAccuracy &o)
+    {
+        if (o.thresholds != thresholds)
+            throw std::invalid_argument("cannot merge metrics with different thresholds");
+        n += o.n;
+        for (size_t i = 0; i < thresholds.size(); ++i)
+        {
+            correct[i] += o.correct[i];
+            TP[i] += o.TP[i];
+            FP[i] += o.FP[i];
+            FN[i] += o.FN[i];
+        }
+    }
+
+    /** Forget all counts, but keep the thresholds and the curves. */
+    void reset()
+    {
+        n = 0;
+        std::fill(correct.begin(), correct.end(), 0);
+        std::fill(TP.begin(), TP.end(), 0);
+        std::fill(FP.begin(), FP.end(), 0);
+        std::fill(FN.begin(), FN.end(), 0);
+    }
+
+    /** Append the current values of all thresholds to `curves()`. */
+    void end_window()
+    {
+        for (size_t i = 0; i < thresholds.size(); ++i)
+        {
+            curves_->accuracy.push_back(get_accuracy(i));
+            curves_->precision.push_back(get_precision(i));
+            curves_->recall.push_back(get_recall(i));
+        }
+    }
+
+    const ThresholdCurves &curves() const
+    { return *curves_; }
+
+    double get_accuracy(size_t i) const
+    { return static_cast<double>(correct[i]) / n; }
+
+    double get_precision(size_t i) const
+    { return static_cast<double>(TP[i]) / (TP[i] + FP[i]); }
+
+    double get_recall(size_t i) const
+    { return static_cast<double>(TP[i]) / (TP[i] + FN[i]); }
+
+    double get_score() const
+    { return get_accuracy(0); }
+
+    double get_precision() const
+    { return get_precision(0); }
+
+    double get_recall() const
+    { return get_recall(0); }
+
+private:
+    std::shared_ptr<ThresholdCurves> curves_;
+};
 
 } // namespace bdap
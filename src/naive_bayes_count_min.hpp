@@ -1,40 +1,104 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
+#include <stdexcept>
 #include <string_view>
 #include <vector>
 #include "email.hpp"
 #include "base_classifier.hpp"
+#include "count_min_rows.hpp"
+#include "counters.hpp"
+#include "profile.hpp"
+#include "snapshot.hpp"
+#include "table.hpp"
 
 namespace bdap {
 
-class NaiveBayesCountMin : public BaseClf<NaiveBayesCountMin>
+/**
+ * `Counter` is the type of the bucket counters, see `counters.hpp`.
+ * `NumHashes` fixes the number of rows at compile time, see `CountMinRows`.
+ */
+template <typename Counter = Counter32, int NumHashes = DYNAMIC_ROWS>
+class NaiveBayesCountMin : public BaseClf<NaiveBayesCountMin<Counter, NumHashes>>
 {
+    using Base = BaseClf<NaiveBayesCountMin<Counter, NumHashes>>;
+    using Base::prefetch;
+    using Base::PREFETCH_DISTANCE;
+    using value_type = typename Counter::value_type;
+
     int log_num_buckets_;
-    std::vector<int> buckets_; // First num_buckets are ham, rest num_buckets is spam
-    std::vector<int> seeds_;
-    int num_buckets_;
-    int num_ngram_spam;
-    int num_ngram_ham;
-    int num_spam;
-    int num_ham;
-    int num_hashes_;
-    int offset_;
+    Table<value_type> buckets_; // ham count at slot*bucket_stride_, spam count class_stride_ further
+    Table<double> log_buckets_; // log of buckets_ if Counter::cache_logs, kept up to date by update_
+    std::vector<size_t> seeds_;
+    size_t num_buckets_;
+    size_t bucket_mask_; // num_buckets_ - 1
+    uint64_t num_ngram_spam;
+    uint64_t num_ngram_ham;
+    uint64_t num_spam;
+    uint64_t num_ham;
+    CountMinRows<NumHashes> num_hashes_;
+    bool double_hashing_; // derive all rows from one 128-bit hash
+    size_t offset_; // number of buckets over all rows
+    size_t bucket_stride_;
+    size_t class_stride_;
     // For different hash functions, the seed can be changed
 
+    // Saturation statistics
+    CounterRng rng_;
+    uint64_t num_increments_ = 0;
+    uint64_t num_saturated_ = 0;
+
+    std::vector<size_t> slots_; // scratch space of update_ and predict_and_update_
+
+    /** Everything but the tables, as stored in a snapshot. */
+    struct SnapshotState
+    {
+        int64_t log_num_buckets;
+        int64_t num_hashes;
+        uint64_t double_hashing;
+        uint64_t conservative_update;
+        uint64_t bucket_stride;
+        uint64_t class_stride;
+        uint64_t num_ngram_spam;
+        uint64_t num_ngram_ham;
+        uint64_t num_spam;
+        uint64_t num_ham;
+        uint64_t rng;
+        uint64_t num_increments;
+        uint64_t num_saturated;
+    };
+
+    NaiveBayesCountMin() : num_hashes_(NumHashes) {} // for load
+
 public:
-    NaiveBayesCountMin(int num_hashes, int log_num_buckets, double threshold)
-            : log_num_buckets_(log_num_buckets), num_buckets_(1 << log_num_buckets),
-              num_hashes_(num_hashes), offset_(num_hashes_ * num_buckets_)
+    /** Conservative update: only increment the rows of an n-gram whose
+     * count is the current minimum, instead of all rows. The minimum, which
+     * is the estimate, still grows by one, but the other rows overestimate
+     * less. */
+    bool conservative_update = false;
+
+    NaiveBayesCountMin(int num_hashes, int log_num_buckets, double threshold,
+                       bool double_hashing = false,
+                       BucketLayout layout = BucketLayout::by_class)
+            : log_num_buckets_(log_num_buckets), num_buckets_(size_t{1} << log_num_buckets),
+              bucket_mask_(num_buckets_ - 1),
+              num_hashes_(num_hashes), double_hashing_(double_hashing), offset_(num_hashes_ * num_buckets_)
     {
-        buckets_.resize(2 * offset_, 1);
+        bool interleaved = layout == BucketLayout::interleaved;
+        bucket_stride_ = interleaved ? 2 : 1;
+        class_stride_ = interleaved ? 1 : offset_;
+
+        buckets_ = Table<value_type>(2 * offset_, value_type{1});
+        if (Counter::cache_logs)
+            log_buckets_ = Table<double>(2 * offset_, 0.0);
         seeds_.resize(num_hashes_);
 
-        seeds_[0] = 0x9748cd;
-        for (int i = 1; i < num_hashes_; i++)
+        for (int i = 0; i < num_hashes_; i++)
         {
-            seeds_[i] = seeds_[i - 1] * i;
+            seeds_[i] = derive_seed(COUNT_MIN_SEED, i);
         }
         num_ngram_spam = 1;
         num_ngram_ham = 1;
@@ -43,72 +107,136 @@ public:
         this->threshold = threshold;
     }
 
-    void update_(const Email &email)
+    void update_(const HashedEmail &email)
     {
-        EmailIter iter = EmailIter(email, this->ngram_k);
-        size_t size = iter.size();
-        int offset;
-        if (email.is_spam())
+        size_t size = email.num_ngrams();
+        size_t offset = count_email(email);
+        slots_.resize(num_hashes_);
+        for (size_t n = 0; n < size; ++n)
         {
-            num_spam++;
-            num_ngram_spam += size;
-            offset = offset_;
-        } else
-        {
-            num_ham++;
-            num_ngram_ham += size;
-            offset = 0;
-        }
-        while (iter)
-        {
-            auto next = iter.next();
+            const uint64_t *hashes = email.ngram(n);
             for (int i = 0; i < num_hashes_; i++)
             {
-                buckets_[offset + i * num_buckets_ + get_bucket(next, seeds_[i])]++;
+                slots_[i] = get_slot(hashes, i);
             }
+            increment_ngram(offset, slots_.data());
         }
     }
 
-    double predict_(const Email &email) const
+    double predict_and_update_(const HashedEmail &email)
     {
-        double probSpam = prob(email, offset_, num_ngram_spam, num_spam);
-        double probHam = prob(email, 0, num_ngram_ham, num_ham);
+        size_t num_ngrams = email.num_ngrams();
 
-        // http://www.cs.cmu.edu/~tom/mlbook/NBayesLogReg.pdf
-        //                      P(Y=1)P(X|Y=1)
-        // P(Y=1|X) = ---------------------------------
-        //              P(Y=1)P(X|Y=1) + P(Y=0)P(X|Y=0)
-        double probability = probSpam - (probSpam + std::log1p(exp(probHam - probSpam)));
-        return std::exp(probability);
+        // the slots are computed once; all of them are looked up before the
+        // email is counted, so the prediction is that of the old model
+        slots_.clear();
+        double countSpam = 0;
+        double countHam = 0;
+        for (size_t n = 0; n < num_ngrams; ++n)
+        {
+            for (int i = 0; i < num_hashes_; i++)
+                slots_.push_back(get_slot(email.ngram(n), i));
+            countSpam += min_log_count(&slots_[n * num_hashes_], class_stride_);
+            countHam += min_log_count(&slots_[n * num_hashes_], 0);
+        }
+        double probSpam = normalize(countSpam, num_ngrams, num_ngram_spam, num_spam);
+        double probHam = normalize(countHam, num_ngrams, num_ngram_ham, num_ham);
+        double prediction = posterior(probSpam, probHam);
+
+        size_t offset = count_email(email);
+        for (size_t n = 0; n < num_ngrams; ++n)
+            increment_ngram(offset, &slots_[n * num_hashes_]);
+        return prediction;
     }
 
-    double prob(const Email &email, int offset, double num_ngram, double num_mail) const
+    double predict_(const HashedEmail &email) const
     {
-        EmailIter iter = EmailIter(email, this->ngram_k);
+        size_t num_ngrams = email.num_ngrams();
 
-        // count = log|X1| + log|X2| + log|Xn|
-        double count = 0;
-        while (iter)
+        // count = log|X1| + log|X2| + log|Xn|, for both classes in one walk
+        double countSpam = 0;
+        double countHam = 0;
+        for (size_t n = 0; n < num_ngrams; ++n)
         {
-            auto next = iter.next();
-            double min = buckets_[offset + get_bucket(next, seeds_[0])];
+            const uint64_t *hashes = email.ngram(n);
+            // log is monotonic: the log of the smallest count is the
+            // smallest log-count
+            size_t slot = get_slot(hashes, 0);
+            double minSpam = log_at(slot + class_stride_);
+            double minHam = log_at(slot);
             for (int i = 1; i < num_hashes_; i++)
             {
                 // Find min
-                double current_value = buckets_[offset + i * num_buckets_ + get_bucket(next, seeds_[i])];
-                if (current_value < min)
+                slot = get_slot(hashes, i);
+                minSpam = std::min(minSpam, log_at(slot + class_stride_));
+                minHam = std::min(minHam, log_at(slot));
+            }
+            // Use smallest
+            countSpam += minSpam;
+            countHam += minHam;
+        }
+
+        double probSpam = normalize(countSpam, num_ngrams, num_ngram_spam, num_spam);
+        double probHam = normalize(countHam, num_ngrams, num_ngram_ham, num_ham);
+        return posterior(probSpam, probHam);
+    }
+
+    void predict_batch_(span<const HashedEmail> emails, span<double> out) const
+    {
+        // gather the slots of all rows for the whole batch first, then look
+        // them up
+        std::vector<size_t> slots;
+        for (const HashedEmail &email : emails)
+            for (size_t n = 0; n < email.num_ngrams(); ++n)
+                for (int i = 0; i < num_hashes_; i++)
+                    slots.push_back(get_slot(email.ngram(n), i));
+
+        BDAP_PHASE(lookup);
+        size_t j = 0;
+        for (size_t e = 0; e < emails.size(); ++e)
+        {
+            size_t num_ngrams = emails[e].num_ngrams();
+            double countSpam = 0;
+            double countHam = 0;
+            for (size_t n = 0; n < num_ngrams; ++n, j += num_hashes_)
+            {
+                size_t ahead = j + PREFETCH_DISTANCE * num_hashes_;
+                for (int i = 0; i < num_hashes_ && ahead + i < slots.size(); i++)
                 {
-                    min = current_value;
+                    prefetch(address_of(slots[ahead + i]));
+                    if (class_stride_ != 1) // else on the same cache line
+                        prefetch(address_of(slots[ahead + i] + class_stride_));
                 }
+                countSpam += min_log_count(&slots[j], class_stride_);
+                countHam += min_log_count(&slots[j], 0);
             }
-            // Use smallest
-            count += (std::log(min));
+            double probSpam = normalize(countSpam, num_ngrams, num_ngram_spam, num_spam);
+            double probHam = normalize(countHam, num_ngrams, num_ngram_ham, num_ham);
+            out[e] = posterior(probSpam, probHam);
         }
+    }
+
+    /** The posterior P(spam|X) from the log-joint probabilities of both
+     * classes. */
+    static double posterior(double probSpam, double probHam)
+    {
+        // http://www.cs.cmu.edu/~tom/mlbook/NBayesLogReg.pdf
+        //                      P(Y=1)P(X|Y=1)
+        // P(Y=1|X) = ---------------------------------
+        //              P(Y=1)P(X|Y=1) + P(Y=0)P(X|Y=0)
+        double probability = probSpam - (probSpam + std::log1p(exp(probHam - probSpam)));
+        return std::exp(probability);
+    }
+
+    /** Turn the sum of the log-counts of an email's n-grams into the
+     * log-joint probability of the email and a class. */
+    double normalize(double count, size_t num_ngrams, double num_ngram, double num_mail) const
+    {
         // count = (log|X1| + log|X2| + log|Xn|) - log(|S_ngrams| or |Hn_grams|)*n
         //                       |X1|                         |Xn|
         // count = log ------------------------ + log ------------------------
         //             |S_ngrams| or |H_ngrams|       |S_ngrams| or |H_ngrams|
-        count -= (iter.size() * log(num_ngram));
+        count -= (num_ngrams * log(num_ngram));
 
         //                       |X1|                         |Xn|                         |S or H mails|
         // count = log ------------------------ + log ------------------------ + log ------------------------
@@ -117,14 +245,220 @@ public:
         return count;
     }
 
+    FeatureHasher hasher() const
+    {
+        if (double_hashing_)
+            return this->make_hasher({seeds_[0]}, true);
+        return this->make_hasher(seeds_);
+    }
+
+    /** Number of counter increments, and how many of them were lost because
+     * the counter was saturated. */
+    uint64_t num_increments() const { return num_increments_; }
+    uint64_t num_saturated() const { return num_saturated_; }
+
+    /**
+     * Add the counts of `o` to this model, as if this model had also been
+     * trained on the emails of `o` (see `train_sharded`). Both models start
+     * at the Laplace count of 1, which is only counted once.
+     *
+     * Throws `std::invalid_argument` if `o` hashes differently or has a
+     * different number of rows, table size or layout, or if either model
+     * uses `conservative_update`: conservative counts depend on the order
+     * of the updates, so they do not add up.
+     */
+    void merge(const NaiveBayesCountMin& o)
+    {
+        if (conservative_update || o.conservative_update)
+            throw std::invalid_argument("cannot merge Naive Bayes models with conservative updates");
+        if (hasher() != o.hasher() || num_hashes_ != o.num_hashes_
+                || num_buckets_ != o.num_buckets_
+                || bucket_stride_ != o.bucket_stride_ || class_stride_ != o.class_stride_)
+            throw std::invalid_argument("cannot merge Naive Bayes models with different hashing or sizes");
+
+        for (size_t i = 0; i < buckets_.size(); ++i)
+        {
+            if (o.buckets_[i] == 1)
+                continue;
+            if (!Counter::merge(buckets_[i], o.buckets_[i], rng_))
+                ++num_saturated_;
+            if constexpr (Counter::cache_logs)
+                log_buckets_[i] = Counter::log_value(buckets_[i]);
+        }
+
+        num_ngram_spam += o.num_ngram_spam - 1;
+        num_ngram_ham += o.num_ngram_ham - 1;
+        num_spam += o.num_spam - 1;
+        num_ham += o.num_ham - 1;
+        num_increments_ += o.num_increments_;
+        num_saturated_ += o.num_saturated_;
+        this->num_examples_processed += o.num_examples_processed;
+    }
+
+    /** Reseed the random number generator of the probabilistic counters,
+     * see `train_sharded`. */
+    void seed_rng(uint64_t seed)
+    { rng_.seed(seed); }
+
+    /** Forget all emails: reset the counts to their initial state. */
+    void clear()
+    {
+        std::fill(buckets_.begin(), buckets_.end(), value_type{1});
+        std::fill(log_buckets_.begin(), log_buckets_.end(), 0.0);
+        num_ngram_spam = 1;
+        num_ngram_ham = 1;
+        num_spam = 1;
+        num_ham = 1;
+        num_increments_ = 0;
+        num_saturated_ = 0;
+        this->num_examples_processed = 0;
+    }
+
+    /** Write the model to a snapshot, see `save_snapshot`. */
+    void save(SnapshotWriter& writer) const
+    {
+        SnapshotState state{log_num_buckets_, num_hashes_, double_hashing_, conservative_update,
+                            bucket_stride_, class_stride_,
+                            num_ngram_spam, num_ngram_ham, num_spam, num_ham,
+                            rng_.state, num_increments_, num_saturated_};
+        writer.header(*this, SnapshotKind::naive_bayes_count_min, Counter::snapshot_id, state);
+        writer.table(seeds_);
+        writer.table(buckets_);
+        writer.table(log_buckets_);
+    }
+
+    /** Read a model from a snapshot, see `load_snapshot`. The count tables
+     * stay in the snapshot. Throws `std::invalid_argument` if the snapshot
+     * has a different number of rows than `NumHashes`. */
+    static NaiveBayesCountMin load(SnapshotReader& reader)
+    {
+        NaiveBayesCountMin clf;
+        auto state = reader.header<SnapshotState>(clf, SnapshotKind::naive_bayes_count_min,
+                                                  Counter::snapshot_id);
+        clf.log_num_buckets_ = snapshot_log_num_buckets(state.log_num_buckets);
+        clf.num_buckets_ = size_t{1} << clf.log_num_buckets_;
+        clf.bucket_mask_ = clf.num_buckets_ - 1;
+        clf.num_hashes_ = CountMinRows<NumHashes>(snapshot_num_hashes(state.num_hashes));
+        clf.double_hashing_ = state.double_hashing != 0;
+        clf.conservative_update = state.conservative_update != 0;
+        clf.offset_ = clf.num_hashes_ * clf.num_buckets_;
+        check_snapshot_strides(state.bucket_stride, state.class_stride, clf.offset_);
+        clf.bucket_stride_ = state.bucket_stride;
+        clf.class_stride_ = state.class_stride;
+        clf.num_ngram_spam = state.num_ngram_spam;
+        clf.num_ngram_ham = state.num_ngram_ham;
+        clf.num_spam = state.num_spam;
+        clf.num_ham = state.num_ham;
+        clf.rng_.state = state.rng;
+        clf.num_increments_ = state.num_increments;
+        clf.num_saturated_ = state.num_saturated;
+        clf.seeds_ = reader.vector<size_t>();
+        clf.buckets_ = reader.table<value_type>();
+        clf.log_buckets_ = reader.table<double>();
+        if (clf.seeds_.size() != static_cast<size_t>(clf.num_hashes_)
+                || clf.buckets_.size() != 2 * clf.offset_
+                || clf.log_buckets_.size() != (Counter::cache_logs ? clf.buckets_.size() : 0))
+            throw std::runtime_error("model snapshot has a table of the wrong size");
+        return clf;
+    }
+
 private:
-    size_t get_bucket(std::string_view ngram, int seed) const
-    { return get_bucket(hash(ngram, seed)); }
+    /** Count `email` in the class totals. Returns the offset of the counts
+     * of its class. */
+    size_t count_email(const HashedEmail &email)
+    {
+        size_t size = email.num_ngrams();
+        if (email.is_spam())
+        {
+            num_spam++;
+            num_ngram_spam += size;
+            return class_stride_;
+        } else
+        {
+            num_ham++;
+            num_ngram_ham += size;
+            return 0;
+        }
+    }
+
+    /** Count an n-gram with the given slots in the class at `offset`. */
+    void increment_ngram(size_t offset, const size_t *slots)
+    {
+        if (!conservative_update)
+        {
+            for (int i = 0; i < num_hashes_; i++)
+                increment(offset + slots[i]);
+            return;
+        }
+
+        value_type min = buckets_[offset + slots[0]];
+        for (int i = 1; i < num_hashes_; i++)
+            min = std::min(min, buckets_[offset + slots[i]]);
+        for (int i = 0; i < num_hashes_; i++)
+            if (buckets_[offset + slots[i]] == min)
+                increment(offset + slots[i]);
+    }
+
+    void increment(size_t slot)
+    {
+        ++num_increments_;
+        if (!Counter::increment(buckets_[slot], rng_))
+            ++num_saturated_;
+        if constexpr (Counter::cache_logs)
+            log_buckets_[slot] = Counter::log_value(buckets_[slot]);
+    }
+
+    double log_at(size_t slot) const
+    {
+        if constexpr (Counter::cache_logs)
+            return log_buckets_[slot];
+        else
+            return Counter::log_value(buckets_[slot]);
+    }
+
+    const void *address_of(size_t slot) const
+    {
+        if constexpr (Counter::cache_logs)
+            return &log_buckets_[slot];
+        else
+            return &buckets_[slot];
+    }
+
+    /** The smallest log-count over the rows of an n-gram, given its slot
+     * in each row. */
+    double min_log_count(const size_t *slots, size_t offset) const
+    {
+        double min = log_at(offset + slots[0]);
+        for (int i = 1; i < num_hashes_; i++)
+        {
+            double current_value = log_at(offset + slots[i]);
+            if (current_value < min)
+            {
+                min = current_value;
+            }
+        }
+        return min;
+    }
+
+    /** Where the ham count of row `row` for an n-gram with the given hashes
+     * is stored; the spam count is `class_stride_` further. */
+    size_t get_slot(const uint64_t *hashes, int row) const
+    { return (row * num_buckets_ + get_bucket(hashes, row)) * bucket_stride_; }
+
+    /** The bucket of row `row` for an n-gram with the given hashes. */
+    size_t get_bucket(const uint64_t *hashes, int row) const
+    {
+        // an odd stride, so that the rows stay distinct modulo the
+        // power-of-two table size
+        if (double_hashing_)
+            return get_bucket(hashes[0] + row * (hashes[1] | 1));
+        return get_bucket(hashes[row]);
+    }
 
     size_t get_bucket(size_t hash) const
     {
-        hash = hash % num_buckets_;
-        return hash;
+        // num_buckets_ is a power of two
+        return hash & bucket_mask_;
     }
 };
 
@@ -1,32 +1,85 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
+#include <stdexcept>
 #include <string_view>
 #include <vector>
 #include <memory>
 #include "email.hpp"
 #include "base_classifier.hpp"
+#include "counters.hpp"
+#include "profile.hpp"
+#include "snapshot.hpp"
+#include "table.hpp"
 
 namespace bdap {
 
-class NaiveBayesFeatureHashing : public BaseClf<NaiveBayesFeatureHashing>
+/**
+ * `Counter` is the type of the bucket counters, see `counters.hpp`.
+ */
+template <typename Counter = Counter32>
+class NaiveBayesFeatureHashing : public BaseClf<NaiveBayesFeatureHashing<Counter>>
 {
+    using Base = BaseClf<NaiveBayesFeatureHashing<Counter>>;
+    using Base::prefetch;
+    using Base::PREFETCH_DISTANCE;
+    using value_type = typename Counter::value_type;
+
     int log_num_buckets_;
-    std::vector<int> buckets_; // First num_buckets are ham, rest num_buckets is spam
+    Table<value_type> buckets_; // ham count at bucket*bucket_stride_, spam count class_stride_ further
+    Table<double> log_buckets_; // log of buckets_ if Counter::cache_logs, kept up to date by update_
 
-    int num_buckets_;
-    double num_ngram_spam;
-    double num_ngram_ham;
-    double num_spam;
-    double num_ham;
+    size_t num_buckets_;
+    size_t bucket_mask_; // num_buckets_ - 1
+    size_t bucket_stride_;
+    size_t class_stride_;
+    uint64_t num_ngram_spam;
+    uint64_t num_ngram_ham;
+    uint64_t num_spam;
+    uint64_t num_ham;
     int seed_;
+    bool double_hashing_ = false; // see use_count_min_hashing
+
+    // Saturation statistics
+    CounterRng rng_;
+    uint64_t num_increments_ = 0;
+    uint64_t num_saturated_ = 0;
+
+    std::vector<size_t> buckets_scratch_; // scratch space of predict_and_update_
+
+    /** Everything but the tables, as stored in a snapshot. */
+    struct SnapshotState
+    {
+        int64_t log_num_buckets;
+        uint64_t bucket_stride;
+        uint64_t class_stride;
+        uint64_t num_ngram_spam;
+        uint64_t num_ngram_ham;
+        uint64_t num_spam;
+        uint64_t num_ham;
+        int64_t seed;
+        uint64_t double_hashing;
+        uint64_t rng;
+        uint64_t num_increments;
+        uint64_t num_saturated;
+    };
+
+    NaiveBayesFeatureHashing() = default; // for load
 
 public:
-    NaiveBayesFeatureHashing(int log_num_buckets, double threshold)
-            : log_num_buckets_(log_num_buckets), seed_(0x249cd), num_buckets_(1 << log_num_buckets),
-              buckets_(2 * (1 << log_num_buckets), 1)
+    NaiveBayesFeatureHashing(int log_num_buckets, double threshold,
+                             BucketLayout layout = BucketLayout::by_class)
+            : log_num_buckets_(log_num_buckets), seed_(0x249cd), num_buckets_(size_t{1} << log_num_buckets),
+              bucket_mask_(num_buckets_ - 1), buckets_(2 * (size_t{1} << log_num_buckets), value_type{1}),
+              log_buckets_(Counter::cache_logs ? 2 * (size_t{1} << log_num_buckets) : 0, 0.0)
     {
+        bool interleaved = layout == BucketLayout::interleaved;
+        bucket_stride_ = interleaved ? 2 : 1;
+        class_stride_ = interleaved ? 1 : num_buckets_;
+
         num_ngram_spam = 1;
         num_ngram_ham = 1;
         num_spam = 1;
@@ -37,32 +90,101 @@ public:
         this->threshold = threshold;
     }
 
-    void update_(const Email &email)
+    void update_(const HashedEmail &email)
     {
-        EmailIter iter = EmailIter(email, this->ngram_k);
-        int offset;
-        if (email.is_spam())
+        size_t num_ngrams = email.num_ngrams();
+        size_t offset = count_email(email);
+        for (size_t i = 0; i < num_ngrams; ++i)
         {
-            num_spam++;
-            num_ngram_spam += iter.size();
-            offset = num_buckets_;
-        } else
+            increment(offset + get_bucket(email.hash(i)) * bucket_stride_);
+        }
+    }
+
+    double predict_and_update_(const HashedEmail &email)
+    {
+        size_t num_ngrams = email.num_ngrams();
+
+        // the buckets are computed once; all of them are looked up before
+        // the email is counted, so the prediction is that of the old model
+        buckets_scratch_.clear();
+        double countSpam = 0;
+        double countHam = 0;
+        for (size_t i = 0; i < num_ngrams; ++i)
         {
-            num_ham++;
-            num_ngram_ham += iter.size();
-            offset = 0;
+            size_t bucket = get_bucket(email.hash(i)) * bucket_stride_;
+            buckets_scratch_.push_back(bucket);
+            countSpam += log_at(bucket + class_stride_);
+            countHam += log_at(bucket);
         }
-        while (iter)
+        double probSpam = normalize(countSpam, num_ngrams, num_ngram_spam, num_spam);
+        double probHam = normalize(countHam, num_ngrams, num_ngram_ham, num_ham);
+        double prediction = posterior(probSpam, probHam);
+
+        size_t offset = count_email(email);
+        for (size_t bucket : buckets_scratch_)
+            increment(offset + bucket);
+        return prediction;
+    }
+
+    // https://www.atoti.io/articles/how-to-solve-the-zero-frequency-problem-in-naive-bayes/
+    //     P(S)        P(X1|S)         P(X2|S)         P(Xn|S)
+    // log ---- + log --------- + log --------- + log --------- = prob(Spam) - prob(Ham)
+    //     P(H)        P(X1|H)         P(X2|H)         P(Xn|H)
+    double predict_(const HashedEmail &email) const
+    {
+        size_t num_ngrams = email.num_ngrams();
+
+        // count = log|X1| + log|X2| + log|Xn|, for both classes in one walk
+        double countSpam = 0;
+        double countHam = 0;
+        for (size_t i = 0; i < num_ngrams; ++i)
         {
-            buckets_[offset + get_bucket(iter.next())]++;
+            size_t bucket = get_bucket(email.hash(i)) * bucket_stride_;
+            countSpam += log_at(bucket + class_stride_);
+            countHam += log_at(bucket);
         }
+
+        double probSpam = normalize(countSpam, num_ngrams, num_ngram_spam, num_spam);
+        double probHam = normalize(countHam, num_ngrams, num_ngram_ham, num_ham);
+        return posterior(probSpam, probHam);
     }
 
-    double predict_(const Email &email) const
+    void predict_batch_(span<const HashedEmail> emails, span<double> out) const
     {
-        double probSpam = prob(email, num_buckets_, num_ngram_spam, num_spam);
-        double probHam = prob(email, 0, num_ngram_ham, num_ham);
+        // gather the buckets of the whole batch first, then look them up
+        std::vector<size_t> buckets;
+        for (const HashedEmail &email : emails)
+            for (size_t i = 0; i < email.num_ngrams(); ++i)
+                buckets.push_back(get_bucket(email.hash(i)) * bucket_stride_);
 
+        BDAP_PHASE(lookup);
+        size_t j = 0;
+        for (size_t e = 0; e < emails.size(); ++e)
+        {
+            size_t num_ngrams = emails[e].num_ngrams();
+            double countSpam = 0;
+            double countHam = 0;
+            for (size_t end = j + num_ngrams; j < end; ++j)
+            {
+                if (j + PREFETCH_DISTANCE < buckets.size())
+                {
+                    prefetch(address_of(buckets[j + PREFETCH_DISTANCE]));
+                    if (class_stride_ != 1) // else on the same cache line
+                        prefetch(address_of(buckets[j + PREFETCH_DISTANCE] + class_stride_));
+                }
+                countSpam += log_at(buckets[j] + class_stride_);
+                countHam += log_at(buckets[j]);
+            }
+            double probSpam = normalize(countSpam, num_ngrams, num_ngram_spam, num_spam);
+            double probHam = normalize(countHam, num_ngrams, num_ngram_ham, num_ham);
+            out[e] = posterior(probSpam, probHam);
+        }
+    }
+
+    /** The posterior P(spam|X) from the log-joint probabilities of both
+     * classes. */
+    static double posterior(double probSpam, double probHam)
+    {
         // http://www.cs.cmu.edu/~tom/mlbook/NBayesLogReg.pdf
         //                      P(Y=1)P(X|Y=1)
         // P(Y=1|X) = ---------------------------------
@@ -74,25 +196,15 @@ public:
         //return std::exp(probSpam - probHam);
     }
 
-    // https://www.atoti.io/articles/how-to-solve-the-zero-frequency-problem-in-naive-bayes/
-    //     P(S)        P(X1|S)         P(X2|S)         P(Xn|S)
-    // log ---- + log --------- + log --------- + log --------- = prob(Spam) - prob(Ham)
-    //     P(H)        P(X1|H)         P(X2|H)         P(Xn|H)
-    double prob(const Email &email, int offset, double num_ngram, double num_mail) const
+    /** Turn the sum of the log-counts of an email's n-grams into the
+     * log-joint probability of the email and a class. */
+    double normalize(double count, size_t num_ngrams, double num_ngram, double num_mail) const
     {
-        EmailIter iter = EmailIter(email, this->ngram_k);
-
-        // count = log|X1| + log|X2| + log|Xn|
-        double count = 0;
-        while (iter)
-        {
-            count += (std::log(buckets_[offset + get_bucket(iter.next())]));
-        }
         // count = (log|X1| + log|X2| + log|Xn|) - log(|S_ngrams| or |Hn_grams|)*n
         //                       |X1|                         |Xn|
         // count = log ------------------------ + log ------------------------
         //             |S_ngrams| or |H_ngrams|       |S_ngrams| or |H_ngrams|
-        count -= (iter.size() * log(num_ngram));
+        count -= (num_ngrams * log(num_ngram));
 
         //                       |X1|                         |Xn|                         |S or H mails|
         // count = log ------------------------ + log ------------------------ + log ------------------------
@@ -101,22 +213,176 @@ public:
         return count;
     }
 
+    /**
+     * Hash the n-grams the way the Count-Min models with `double_hashing` do:
+     * once, with `COUNT_MIN_SEED`, keeping both halves of the 128-bit hash,
+     * and take the bucket from the first half. Those models can then share
+     * the `HashedEmail`s of this one.
+     */
+    void use_count_min_hashing()
+    {
+        seed_ = COUNT_MIN_SEED;
+        double_hashing_ = true;
+    }
+
+    FeatureHasher hasher() const
+    { return this->make_hasher({static_cast<size_t>(seed_)}, double_hashing_); }
+
+    /** Number of counter increments, and how many of them were lost because
+     * the counter was saturated. */
+    uint64_t num_increments() const { return num_increments_; }
+    uint64_t num_saturated() const { return num_saturated_; }
+
+    /**
+     * Add the counts of `o` to this model, as if this model had also been
+     * trained on the emails of `o` (see `train_sharded`). Both models start
+     * at the Laplace count of 1, which is only counted once.
+     *
+     * Throws `std::invalid_argument` if `o` hashes differently or has a
+     * different table size or layout.
+     */
+    void merge(const NaiveBayesFeatureHashing& o)
+    {
+        if (hasher() != o.hasher() || num_buckets_ != o.num_buckets_
+                || bucket_stride_ != o.bucket_stride_ || class_stride_ != o.class_stride_)
+            throw std::invalid_argument("cannot merge Naive Bayes models with different hashing or sizes");
+
+        for (size_t i = 0; i < buckets_.size(); ++i)
+        {
+            if (o.buckets_[i] == 1)
+                continue;
+            if (!Counter::merge(buckets_[i], o.buckets_[i], rng_))
+                ++num_saturated_;
+            if constexpr (Counter::cache_logs)
+                log_buckets_[i] = Counter::log_value(buckets_[i]);
+        }
+
+        num_ngram_spam += o.num_ngram_spam - 1;
+        num_ngram_ham += o.num_ngram_ham - 1;
+        num_spam += o.num_spam - 1;
+        num_ham += o.num_ham - 1;
+        num_increments_ += o.num_increments_;
+        num_saturated_ += o.num_saturated_;
+        this->num_examples_processed += o.num_examples_processed;
+    }
+
+    /** Reseed the random number generator of the probabilistic counters,
+     * see `train_sharded`. */
+    void seed_rng(uint64_t seed)
+    { rng_.seed(seed); }
+
+    /** Forget all emails: reset the counts to their initial state. */
+    void clear()
+    {
+        std::fill(buckets_.begin(), buckets_.end(), value_type{1});
+        std::fill(log_buckets_.begin(), log_buckets_.end(), 0.0);
+        num_ngram_spam = 1;
+        num_ngram_ham = 1;
+        num_spam = 1;
+        num_ham = 1;
+        num_increments_ = 0;
+        num_saturated_ = 0;
+        this->num_examples_processed = 0;
+    }
+
+    /** Write the model to a snapshot, see `save_snapshot`. */
+    void save(SnapshotWriter& writer) const
+    {
+        SnapshotState state{log_num_buckets_, bucket_stride_, class_stride_,
+                            num_ngram_spam, num_ngram_ham, num_spam, num_ham,
+                            seed_, double_hashing_, rng_.state, num_increments_, num_saturated_};
+        writer.header(*this, SnapshotKind::naive_bayes_feature_hashing, Counter::snapshot_id, state);
+        writer.table(buckets_);
+        writer.table(log_buckets_);
+    }
+
+    /** Read a model from a snapshot, see `load_snapshot`. The tables stay
+     * in the snapshot. */
+    static NaiveBayesFeatureHashing load(SnapshotReader& reader)
+    {
+        NaiveBayesFeatureHashing clf;
+        auto state = reader.header<SnapshotState>(clf, SnapshotKind::naive_bayes_feature_hashing,
+                                                  Counter::snapshot_id);
+        clf.log_num_buckets_ = snapshot_log_num_buckets(state.log_num_buckets);
+        clf.num_buckets_ = size_t{1} << clf.log_num_buckets_;
+        clf.bucket_mask_ = clf.num_buckets_ - 1;
+        check_snapshot_strides(state.bucket_stride, state.class_stride, clf.num_buckets_);
+        clf.bucket_stride_ = state.bucket_stride;
+        clf.class_stride_ = state.class_stride;
+        clf.num_ngram_spam = state.num_ngram_spam;
+        clf.num_ngram_ham = state.num_ngram_ham;
+        clf.num_spam = state.num_spam;
+        clf.num_ham = state.num_ham;
+        clf.seed_ = static_cast<int>(state.seed);
+        clf.double_hashing_ = state.double_hashing != 0;
+        clf.rng_.state = state.rng;
+        clf.num_increments_ = state.num_increments;
+        clf.num_saturated_ = state.num_saturated;
+        clf.buckets_ = reader.table<value_type>();
+        clf.log_buckets_ = reader.table<double>();
+        if (clf.buckets_.size() != 2 * clf.num_buckets_
+                || clf.log_buckets_.size() != (Counter::cache_logs ? clf.buckets_.size() : 0))
+            throw std::runtime_error("model snapshot has a table of the wrong size");
+        return clf;
+    }
+
     void print_weights() const
     {
         for (size_t i = 0; i < num_buckets_; ++i)
         {
-            std::cout << "w" << i << " " << buckets_[i] << ", " << buckets_[num_buckets_ + i] << std::endl;
+            size_t bucket = i * bucket_stride_;
+            std::cout << "w" << i << " " << +buckets_[bucket] << ", " << +buckets_[bucket + class_stride_] << std::endl;
         }
     }
 
 private:
-    size_t get_bucket(std::string_view ngram) const
-    { return get_bucket(hash(ngram, seed_)); }
+    /** Count `email` in the class totals. Returns the offset of the counts
+     * of its class. */
+    size_t count_email(const HashedEmail &email)
+    {
+        size_t num_ngrams = email.num_ngrams();
+        if (email.is_spam())
+        {
+            num_spam++;
+            num_ngram_spam += num_ngrams;
+            return class_stride_;
+        } else
+        {
+            num_ham++;
+            num_ngram_ham += num_ngrams;
+            return 0;
+        }
+    }
+
+    void increment(size_t bucket)
+    {
+        ++num_increments_;
+        if (!Counter::increment(buckets_[bucket], rng_))
+            ++num_saturated_;
+        if constexpr (Counter::cache_logs)
+            log_buckets_[bucket] = Counter::log_value(buckets_[bucket]);
+    }
+
+    double log_at(size_t bucket) const
+    {
+        if constexpr (Counter::cache_logs)
+            return log_buckets_[bucket];
+        else
+            return Counter::log_value(buckets_[bucket]);
+    }
+
+    const void *address_of(size_t bucket) const
+    {
+        if constexpr (Counter::cache_logs)
+            return &log_buckets_[bucket];
+        else
+            return &buckets_[bucket];
+    }
 
     size_t get_bucket(size_t hash) const
     {
-        hash = hash % num_buckets_;
-        return hash;
+        // num_buckets_ is a power of two
+        return hash & bucket_mask_;
     }
 };
 
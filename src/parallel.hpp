@@ -0,0 +1,198 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bdap {
+
+/** The number of worker threads to use by default. */
+inline size_t default_num_threads()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+namespace detail {
+
+/** The first exception thrown by the tasks of a `parallel_for`. */
+class FirstException {
+    std::mutex mutex_;
+    std::exception_ptr error_;
+
+public:
+    void set(std::exception_ptr error)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_)
+            error_ = error;
+    }
+
+    /** Rethrow the exception, if any, and forget it. */
+    void rethrow()
+    {
+        std::exception_ptr error;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::swap(error, error_);
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+} // namespace detail
+
+/**
+ * Call `f(i)` for every `i` in `[0, n)` on up to `num_threads` threads.
+ * Indices are handed out dynamically, so tasks of uneven size balance out.
+ * The calling thread takes part in the work.
+ *
+ * If a task throws, no further tasks are started, and the first exception
+ * is rethrown on the calling thread once the running tasks have finished.
+ */
+template <typename F>
+void parallel_for(size_t n, size_t num_threads, F f)
+{
+    std::atomic<size_t> next{0};
+    detail::FirstException error;
+    auto worker = [&]() {
+        for (size_t i = next++; i < n; i = next++)
+        {
+            try
+            {
+                f(i);
+            }
+            catch (...)
+            {
+                error.set(std::current_exception());
+                next = n;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < std::min(num_threads, n); ++t)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread& t : threads)
+        t.join();
+    error.rethrow();
+}
+
+/**
+ * A fixed set of worker threads for running many small `parallel_for`s,
+ * e.g. one per window of a stream, without starting threads each time.
+ * `size()` counts the calling thread, which takes part in the work.
+ */
+class ThreadPool {
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+
+    // Current task, protected by `mutex_`
+    const std::function<void(size_t)> *task_ = nullptr;
+    size_t n_ = 0;
+    std::atomic<size_t> next_{0};
+    size_t generation_ = 0;
+    size_t num_busy_ = 0;
+    bool stop_ = false;
+    detail::FirstException error_;
+
+public:
+    explicit ThreadPool(size_t num_threads)
+    {
+        for (size_t t = 1; t < num_threads; ++t)
+            threads_.emplace_back([this]() { work(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        work_cv_.notify_all();
+        for (std::thread& t : threads_)
+            t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return threads_.size() + 1; }
+
+    /** Call `f(i)` for every `i` in `[0, n)` and wait until all are done.
+     * Exceptions are handled as by `bdap::parallel_for`. */
+    void parallel_for(size_t n, const std::function<void(size_t)>& f)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_ = &f;
+            n_ = n;
+            next_ = 0;
+            num_busy_ = threads_.size();
+            ++generation_;
+        }
+        work_cv_.notify_all();
+
+        run(f, n);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this]() { return num_busy_ == 0; });
+        task_ = nullptr;
+        lock.unlock();
+        error_.rethrow();
+    }
+
+private:
+    void run(const std::function<void(size_t)>& f, size_t n)
+    {
+        for (size_t i = next_++; i < n; i = next_++)
+        {
+            try
+            {
+                f(i);
+            }
+            catch (...)
+            {
+                error_.set(std::current_exception());
+                next_ = n;
+            }
+        }
+    }
+
+    void work()
+    {
+        size_t generation = 0;
+        while (true)
+        {
+            const std::function<void(size_t)> *task;
+            size_t n;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                work_cv_.wait(lock, [&]() { return stop_ || generation_ != generation; });
+                if (stop_)
+                    return;
+                generation = generation_;
+                task = task_;
+                n = n_;
+            }
+
+            run(*task, n);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --num_busy_;
+            }
+            done_cv_.notify_one();
+        }
+    }
+};
+
+} // namespace bdap
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "hashed_email.hpp"
+#include "parallel.hpp"
+#include "profile.hpp"
+#include "span.hpp"
+
+namespace bdap {
+
+/** The seed from which `train_sharded` derives the counter seeds of its
+ * shards. */
+constexpr size_t SHARD_RNG_SEED = 0x5bd1e995;
+
+/** Throughput of one pass of `train_hogwild` or `train_sharded`. */
+struct TrainingStats
+{
+    size_t num_threads = 0;
+    size_t num_emails = 0;
+    double seconds = 0.0;
+
+    double emails_per_second() const
+    { return num_emails / seconds; }
+};
+
+/**
+ * Train a perceptron on `emails` with `num_threads` threads, Hogwild style
+ * (Recht et al., 2011): the threads take the next email from a shared
+ * counter and update the one model without locks, through
+ * `Clf::learn_shared`. The perceptron updates are sparse, so two threads
+ * rarely touch the same weight, and an update that does get lost costs
+ * little accuracy.
+ *
+ * The order in which the emails are learned, and so the resulting model,
+ * depends on the scheduling of the threads. With one thread, this is plain
+ * serial training with `update`, the baseline to compare against.
+ */
+template <typename Clf>
+TrainingStats train_hogwild(Clf& clf, const std::vector<HashedEmail>& emails, size_t num_threads)
+{
+    TrainingStats stats;
+    stats.num_threads = std::max<size_t>(1, std::min(num_threads, emails.size()));
+    stats.num_emails = emails.size();
+
+    auto begin = std::chrono::steady_clock::now();
+    if (stats.num_threads == 1)
+    {
+        BDAP_PHASE(update);
+        for (const HashedEmail& email : emails)
+            clf.update(email);
+    }
+    else
+    {
+        std::atomic<size_t> next{0};
+        auto worker = [&]() {
+            BDAP_PHASE(update);
+            typename Clf::Scratch scratch;
+            for (size_t i = next++; i < emails.size(); i = next++)
+                clf.learn_shared(emails[i], scratch);
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < stats.num_threads; ++t)
+            threads.emplace_back(worker);
+        worker();
+        for (std::thread& t : threads)
+            t.join();
+
+        clf.num_examples_processed += static_cast<int>(emails.size());
+    }
+    auto end = std::chrono::steady_clock::now();
+    stats.seconds = std::chrono::duration<double>(end - begin).count();
+    return stats;
+}
+
+/**
+ * Train a Naive Bayes model on `emails` with `num_threads` threads. The
+ * emails are split into contiguous shards, one per thread; `clf` learns the
+ * first shard and empty copies of it learn the others, which are then
+ * merged into `clf` with `Clf::merge`.
+ *
+ * With `merge_every`, the emails are processed in rounds of that many, and
+ * the shards are merged after every round, so that `clf` is up to date at
+ * the end of each round and the copies are reused. The counts are additive,
+ * so with exact counters the result is that of serial training, whatever
+ * the number of threads and rounds. Count-Min models with
+ * `conservative_update` cannot be merged (see `NaiveBayesCountMin::merge`).
+ *
+ * Every copy gets its own random number generator seed, so that the
+ * increments of probabilistic counters are independent between shards.
+ */
+template <typename Clf>
+TrainingStats train_sharded(Clf& clf, const std::vector<HashedEmail>& emails, size_t num_threads,
+                            size_t merge_every = 0)
+{
+    TrainingStats stats;
+    stats.num_threads = std::max<size_t>(1, std::min(num_threads, emails.size()));
+    stats.num_emails = emails.size();
+    size_t round = merge_every == 0 ? emails.size() : merge_every;
+
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<Clf> shards(stats.num_threads - 1, clf);
+    for (size_t s = 0; s < shards.size(); ++s)
+    {
+        shards[s].clear();
+        shards[s].seed_rng(derive_seed(SHARD_RNG_SEED, s + 1));
+    }
+
+    for (size_t i = 0; i < emails.size(); i += round)
+    {
+        span<const HashedEmail> block = span<const HashedEmail>(emails).subspan(
+                i, std::min(round, emails.size() - i));
+        parallel_for(stats.num_threads, stats.num_threads, [&](size_t s) {
+            BDAP_PHASE(update);
+            Clf& shard = s == 0 ? clf : shards[s - 1];
+            size_t first = s * block.size() / stats.num_threads;
+            size_t last = (s+1) * block.size() / stats.num_threads;
+            for (size_t u = first; u < last; ++u)
+                shard.update(block[u]);
+        });
+        for (Clf& shard : shards)
+        {
+            clf.merge(shard);
+            shard.clear();
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    stats.seconds = std::chrono::duration<double>(end - begin).count();
+    return stats;
+}
+
+} // namespace bdap
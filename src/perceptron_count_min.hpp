@@ -1,36 +1,72 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
 #include <string_view>
 #include <vector>
 #include "email.hpp"
 #include "base_classifier.hpp"
+#include "count_min_rows.hpp"
+#include "profile.hpp"
+#include "snapshot.hpp"
+#include "table.hpp"
+#include "weights.hpp"
 
 namespace bdap {
 
-class PerceptronCountMin : public BaseClf<PerceptronCountMin>
+/**
+ * `Weight` is the type of the weights, see `weights.hpp`. `NumHashes` fixes
+ * the number of rows at compile time, see `CountMinRows`.
+ */
+template <typename Weight = DoubleWeight, int NumHashes = DYNAMIC_ROWS>
+class PerceptronCountMin : public BaseClf<PerceptronCountMin<Weight, NumHashes>>
 {
+    using value_type = typename Weight::value_type;
+
     int log_num_buckets_;
     double learning_rate_;
     double bias_;
-    std::vector<double> weights_;
-    std::vector<int> seeds_;
+    Table<value_type> weights_;
+    std::vector<size_t> seeds_;
+
+    size_t num_buckets_;
+    size_t bucket_mask_; // num_buckets_ - 1
+    CountMinRows<NumHashes> num_hashes_;
+    bool double_hashing_; // derive all rows from one 128-bit hash
+
+    // scratch space of update_
+    std::vector<uint32_t> buckets_;
+    std::vector<double> row_weights_;
+
+    /** Everything but the tables, as stored in a snapshot. */
+    struct SnapshotState
+    {
+        int64_t log_num_buckets;
+        int64_t num_hashes;
+        uint64_t double_hashing;
+        double learning_rate;
+        double bias;
+    };
 
-    int num_buckets_;
-    int num_hashes_;
+    PerceptronCountMin() : num_hashes_(NumHashes) {} // for load
 
 public:
-    PerceptronCountMin(int num_hashes, int log_num_buckets, double learning_rate)
+    PerceptronCountMin(int num_hashes, int log_num_buckets, double learning_rate,
+                       bool double_hashing = false)
             : log_num_buckets_(log_num_buckets), learning_rate_(learning_rate), bias_(0.0),
-              num_buckets_(1 << log_num_buckets), num_hashes_(num_hashes)
+              num_buckets_(size_t{1} << log_num_buckets), bucket_mask_(num_buckets_ - 1),
+              num_hashes_(num_hashes), double_hashing_(double_hashing)
     {
-        weights_.resize(num_hashes_ * num_buckets_, 0.0);
+        check_bucket_index_range(num_hashes_ * num_buckets_);
+        check_learning_rate<Weight>(learning_rate_);
+
+        weights_ = Table<value_type>(num_hashes_ * num_buckets_ + Weight::padding, value_type{0});
         seeds_.resize(num_hashes_);
 
-        seeds_[0] = 0x9748cd;
-        for (int i = 1; i < num_hashes_; i++)
+        for (int i = 0; i < num_hashes_; i++)
         {
-            seeds_[i] = seeds_[i - 1] * i;
+            seeds_[i] = derive_seed(COUNT_MIN_SEED, i);
         }
 
     }
@@ -38,67 +74,243 @@ public:
     static int signum(double a)
     { return (a > 0) - (a < 0); }
 
-    void update_(const Email &email)
+    void update_(const HashedEmail &email)
+    { predict_and_update_(email); }
+
+    double predict_and_update_(const HashedEmail &email)
+    { return learn<false>(email, buckets_, row_weights_); }
+
+    /** Scratch space of `learn_shared`, one per thread. */
+    struct Scratch
     {
-        EmailIter iter = EmailIter(email, this->ngram_k);
+        std::vector<uint32_t> buckets;
+        std::vector<double> row_weights;
+    };
+
+    /**
+     * Like `learn_one`, but safe to call from several threads at once on the
+     * same model (see `train_hogwild`). The weights and the bias are updated
+     * with relaxed atomics, so concurrent updates of the same weight can be
+     * lost. Does not count the email in `num_examples_processed`.
+     */
+    double learn_shared(const HashedEmail &email, Scratch &scratch)
+    { return learn<true>(email, scratch.buckets, scratch.row_weights); }
+
+    double predict_(const HashedEmail &email) const
+    {
+        if constexpr (NumHashes != DYNAMIC_ROWS)
+        {
+            // the rows of an n-gram fit on the stack
+            double prediction = 0.0;
+            double row_weights[NumHashes];
+            for (size_t n = 0; n < email.num_ngrams(); ++n)
+            {
+                for (int i = 0; i < NumHashes; i++)
+                    row_weights[i] = Weight::value(weights_[i * num_buckets_ + get_bucket(email.ngram(n), i)]);
+                prediction += median(row_weights);
+            }
+            return prediction + bias_;
+        }
+
+        // as many n-grams as fit in a block on the stack at a time
+        constexpr size_t BLOCK = 256;
+        size_t rows = static_cast<size_t>(num_hashes_);
+        if (rows > BLOCK)
+        {
+            std::vector<uint32_t> buckets;
+            std::vector<double> row_weights;
+            get_buckets(email, buckets);
+            return score(buckets, row_weights, bias_);
+        }
+
+        uint32_t buckets[BLOCK];
+        double row_weights[BLOCK];
+        size_t ngrams_per_block = BLOCK / rows;
+        double prediction = 0.0;
+        for (size_t n = 0; n < email.num_ngrams(); n += ngrams_per_block)
+        {
+            size_t end = std::min(email.num_ngrams(), n + ngrams_per_block);
+            size_t j = 0;
+            for (size_t u = n; u < end; ++u)
+                for (int i = 0; i < num_hashes_; i++)
+                    buckets[j++] = static_cast<uint32_t>(i * num_buckets_ + get_bucket(email.ngram(u), i));
+            Weight::gather(weights_.data(), buckets, j, row_weights);
+            for (size_t k = 0; k < j; k += rows)
+                prediction += median(&row_weights[k]);
+        }
+        return prediction + bias_;
+    }
+
+    void predict_batch_(span<const HashedEmail> emails, span<double> out) const
+    {
+        // gather the buckets of all rows for the whole batch first, then
+        // look them up
+        std::vector<uint32_t> buckets;
+        for (const HashedEmail &email : emails)
+            get_buckets(email, buckets);
+
+        std::vector<double> row_weights(buckets.size());
+        {
+            BDAP_PHASE(lookup);
+            Weight::gather(weights_.data(), buckets.data(), buckets.size(), row_weights.data());
+        }
+
+        size_t j = 0;
+        for (size_t e = 0; e < emails.size(); ++e)
+        {
+            double prediction = 0.0;
+            for (size_t n = 0; n < emails[e].num_ngrams(); ++n, j += num_hashes_)
+                prediction += median(&row_weights[j]);
+            out[e] = prediction + bias_;
+        }
+    }
+
+    FeatureHasher hasher() const
+    {
+        if (double_hashing_)
+            return this->make_hasher({seeds_[0]}, true);
+        return this->make_hasher(seeds_);
+    }
+
+    /** Write the model to a snapshot, see `save_snapshot`. */
+    void save(SnapshotWriter& writer) const
+    {
+        SnapshotState state{log_num_buckets_, num_hashes_, double_hashing_, learning_rate_, bias_};
+        writer.header(*this, SnapshotKind::perceptron_count_min, Weight::snapshot_id, state);
+        writer.table(seeds_);
+        writer.table(weights_);
+    }
+
+    /** Read a model from a snapshot, see `load_snapshot`. The weights stay
+     * in the snapshot. Throws `std::invalid_argument` if the snapshot has a
+     * different number of rows than `NumHashes`. */
+    static PerceptronCountMin load(SnapshotReader& reader)
+    {
+        PerceptronCountMin clf;
+        auto state = reader.header<SnapshotState>(clf, SnapshotKind::perceptron_count_min,
+                                                  Weight::snapshot_id);
+        clf.log_num_buckets_ = snapshot_log_num_buckets(state.log_num_buckets);
+        clf.num_buckets_ = size_t{1} << clf.log_num_buckets_;
+        clf.bucket_mask_ = clf.num_buckets_ - 1;
+        clf.num_hashes_ = CountMinRows<NumHashes>(snapshot_num_hashes(state.num_hashes));
+        clf.double_hashing_ = state.double_hashing != 0;
+        clf.learning_rate_ = state.learning_rate;
+        clf.bias_ = state.bias;
+        clf.seeds_ = reader.vector<size_t>();
+        clf.weights_ = reader.table<value_type>();
+        if (clf.seeds_.size() != static_cast<size_t>(clf.num_hashes_)
+                || clf.weights_.size() != clf.num_hashes_ * clf.num_buckets_ + Weight::padding)
+            throw std::runtime_error("model snapshot has a table of the wrong size");
+        return clf;
+    }
+
+private:
+    /** The perceptron update, with `buckets` and `row_weights` as scratch
+     * space. With `Shared`, other threads may update the model at the same
+     * time. */
+    template <bool Shared>
+    double learn(const HashedEmail &email, std::vector<uint32_t>& buckets,
+                 std::vector<double>& row_weights)
+    {
+        // the buckets are computed once, for both the prediction and the
+        // update
+        buckets.clear();
+        get_buckets(email, buckets);
 
         // w(n+1) = w(n) + l[d(n) - y(n)]x(n)
-        int yn = signum(predict_(email));
+        double bias = Shared ? detail::load_relaxed(bias_) : bias_;
+        double prediction = score(buckets, row_weights, bias);
+        int yn = signum(prediction);
         int dn;
         if (email.is_spam()) dn = 1;
         else dn = -1;
 
         int error = dn - yn;
-        while (iter && error != 0)
+        if (error != 0)
         {
-            auto next = iter.next();
-            for (int hash = 0; hash < num_hashes_; hash++)
-            {
-                weights_[hash * num_buckets_ + get_bucket(next, seeds_[hash])] += learning_rate_ * error;
-            }
+            for (uint32_t bucket : buckets)
+                add(weights_[bucket], learning_rate_ * error, Shared);
+            add_bias(learning_rate_ * error, Shared);
         }
+        return prediction;
+    }
 
-        bias_ += learning_rate_ * error;
+    static void add(value_type& w, double delta, bool shared)
+    {
+        if (shared)
+            add_relaxed<Weight>(w, delta);
+        else
+            Weight::add(w, delta);
     }
 
-    double predict_(const Email &email) const
+    void add_bias(double delta, bool shared)
     {
-        EmailIter iter = EmailIter(email, this->ngram_k);
-        double prediction = 0.0;
+        if (shared)
+            add_relaxed<DoubleWeight>(bias_, delta);
+        else
+            bias_ += delta;
+    }
 
-        std::vector<double> median_weights(num_hashes_);
+    /** The prediction for an email with the given buckets, using
+     * `row_weights` as scratch space. */
+    double score(const std::vector<uint32_t>& buckets, std::vector<double>& row_weights,
+                 double bias) const
+    {
+        row_weights.resize(buckets.size());
+        Weight::gather(weights_.data(), buckets.data(), buckets.size(), row_weights.data());
 
-        while(iter)
-        {
-            auto next = iter.next();
+        double prediction = 0.0;
+        for (size_t j = 0; j < row_weights.size(); j += num_hashes_)
+            prediction += median(&row_weights[j]);
+        return prediction + bias;
+    }
+
+    /** Append the bucket in every row of every n-gram of `email` to
+     * `buckets`, n-gram major. */
+    void get_buckets(const HashedEmail &email, std::vector<uint32_t>& buckets) const
+    {
+        for (size_t n = 0; n < email.num_ngrams(); ++n)
             for (int i = 0; i < num_hashes_; i++)
-            {
-                median_weights[i] = weights_[i * num_buckets_ + get_bucket(next,seeds_[i])];
-            }
+                buckets.push_back(static_cast<uint32_t>(i * num_buckets_ + get_bucket(email.ngram(n), i)));
+    }
 
-            int n = median_weights.size();
-            if (n % 2 == 0)
-            {
-                nth_element(median_weights.begin(), median_weights.begin() + n / 2, median_weights.end());
-                nth_element(median_weights.begin(), median_weights.begin() + (n - 1) / 2, median_weights.end());
-                prediction += (double) (median_weights[(n - 1) / 2] + median_weights[n / 2]) / 2.0;
-            } else
-            {
-                nth_element(median_weights.begin(), median_weights.begin() + n / 2, median_weights.end());
-                prediction += (double) median_weights[n / 2];
-            }
+    /** The median of the weights of the rows of an n-gram. Reorders them. */
+    double median(double *row_weights) const
+    {
+        if constexpr (has_median_network<NumHashes>())
+            return median_network<NumHashes>(row_weights);
+        else
+            return median(row_weights, num_hashes_);
+    }
+
+    static double median(double *median_weights, int n)
+    {
+        if (n % 2 == 0)
+        {
+            std::nth_element(median_weights, median_weights + n / 2, median_weights + n);
+            std::nth_element(median_weights, median_weights + (n - 1) / 2, median_weights + n);
+            return (double) (median_weights[(n - 1) / 2] + median_weights[n / 2]) / 2.0;
+        } else
+        {
+            std::nth_element(median_weights, median_weights + n / 2, median_weights + n);
+            return (double) median_weights[n / 2];
         }
-        return prediction + bias_;
     }
 
-private:
-    size_t get_bucket(std::string_view ngram, int seed) const
-    { return get_bucket(hash(ngram, seed)); }
+    /** The bucket of row `row` for an n-gram with the given hashes. */
+    size_t get_bucket(const uint64_t *hashes, int row) const
+    {
+        // an odd stride, so that the rows stay distinct modulo the
+        // power-of-two table size
+        if (double_hashing_)
+            return get_bucket(hashes[0] + row * (hashes[1] | 1));
+        return get_bucket(hashes[row]);
+    }
 
     size_t get_bucket(size_t hash) const
     {
-        hash = hash % num_buckets_;
-        return hash;
+        // num_buckets_ is a power of two
+        return hash & bucket_mask_;
     }
 };
 
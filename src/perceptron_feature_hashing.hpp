@@ -1,83 +1,239 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
 #include <string_view>
 #include <vector>
 #include "email.hpp"
 #include "base_classifier.hpp"
+#include "profile.hpp"
+#include "snapshot.hpp"
+#include "table.hpp"
+#include "weights.hpp"
 
 namespace bdap {
 
-class PerceptronFeatureHashing : public BaseClf<PerceptronFeatureHashing>
+/**
+ * `Weight` is the type of the weights, see `weights.hpp`.
+ */
+template <typename Weight = DoubleWeight>
+class PerceptronFeatureHashing : public BaseClf<PerceptronFeatureHashing<Weight>>
 {
+    using value_type = typename Weight::value_type;
+
     int log_num_buckets_;
     double learning_rate_;
     double bias_;
-    std::vector<double> weights_;
-    int num_buckets_;
+    Table<value_type> weights_;
+    size_t num_buckets_;
+    size_t bucket_mask_; // num_buckets_ - 1
 
     int seed_;
+    bool double_hashing_ = false; // see use_count_min_hashing
+    std::vector<uint32_t> buckets_; // scratch space of update_
+
+    /** Everything but the weights, as stored in a snapshot. */
+    struct SnapshotState
+    {
+        int64_t log_num_buckets;
+        double learning_rate;
+        double bias;
+        int64_t seed;
+        uint64_t double_hashing;
+    };
+
+    PerceptronFeatureHashing() = default; // for load
 
 public:
     PerceptronFeatureHashing(int log_num_buckets, double learning_rate)
             : log_num_buckets_(log_num_buckets), learning_rate_(learning_rate), bias_(0.0), seed_(0x9748cd),
-              num_buckets_(1 << log_num_buckets)
+              num_buckets_(size_t{1} << log_num_buckets), bucket_mask_(num_buckets_ - 1)
     {
+        check_bucket_index_range(num_buckets_);
+        check_learning_rate<Weight>(learning_rate_);
+
         // set all weights to zero
-        weights_.resize(num_buckets_, 0.0);
+        weights_ = Table<value_type>(num_buckets_ + Weight::padding, value_type{0});
     }
 
     static int signum(double a)
     { return (a > 0) - (a < 0); }
 
-    void update_(const Email &email)
-    {
-        EmailIter iter = EmailIter(email, this->ngram_k);
+    void update_(const HashedEmail &email)
+    { predict_and_update_(email); }
 
-        // w(n+1) = w(n) + l[d(n) - y(n)]x(n)
-        int yn = signum(predict_(email));
-        int dn;
-        if (email.is_spam()) dn = 1;
-        else dn = -1;
+    double predict_and_update_(const HashedEmail &email)
+    { return learn<false>(email, buckets_); }
 
-        int error = dn - yn;
-        while (iter && error != 0)
+    /** Scratch space of `learn_shared`, one per thread. */
+    struct Scratch
+    {
+        std::vector<uint32_t> buckets;
+    };
+
+    /**
+     * Like `learn_one`, but safe to call from several threads at once on the
+     * same model (see `train_hogwild`). The weights and the bias are updated
+     * with relaxed atomics, so concurrent updates of the same weight can be
+     * lost. Does not count the email in `num_examples_processed`.
+     */
+    double learn_shared(const HashedEmail &email, Scratch &scratch)
+    { return learn<true>(email, scratch.buckets); }
+
+    double predict_(const HashedEmail &email) const
+    {
+        // the buckets are summed a block at a time from the stack, so that
+        // predicting does not allocate, in the same order as `sum_weights`
+        uint32_t buckets[SUM_BLOCK];
+        double sum = 0.0;
+        for (size_t i = 0; i < email.num_ngrams(); i += SUM_BLOCK)
         {
-            weights_[get_bucket(iter.next())] += learning_rate_ * error;
+            size_t n = std::min(SUM_BLOCK, email.num_ngrams() - i);
+            for (size_t j = 0; j < n; ++j)
+                buckets[j] = static_cast<uint32_t>(get_bucket(email.hash(i + j)));
+            sum += Weight::sum(weights_.data(), buckets, n);
         }
-
-        bias_ += learning_rate_ * error;
+        return sum + bias_;
     }
 
-    double predict_(const Email &email) const
+    void predict_batch_(span<const HashedEmail> emails, span<double> out) const
     {
-        EmailIter iter = EmailIter(email, this->ngram_k);
-        double prediction = 0.0;
-        while (iter)
+        // gather the buckets of the whole batch first, then look them up
+        std::vector<uint32_t> buckets;
+        for (const HashedEmail &email : emails)
+            get_buckets(email, buckets);
+
+        BDAP_PHASE(lookup);
+        size_t j = 0;
+        for (size_t e = 0; e < emails.size(); ++e)
         {
-            prediction += weights_[get_bucket(iter.next())];
+            size_t num_ngrams = emails[e].num_ngrams();
+            out[e] = sum_weights(buckets.data() + j, num_ngrams) + bias_;
+            j += num_ngrams;
         }
+    }
+
+    /**
+     * Hash the n-grams the way the Count-Min models with `double_hashing` do:
+     * once, with `COUNT_MIN_SEED`, keeping both halves of the 128-bit hash,
+     * and take the bucket from the first half. Those models can then share
+     * the `HashedEmail`s of this one.
+     */
+    void use_count_min_hashing()
+    {
+        seed_ = COUNT_MIN_SEED;
+        double_hashing_ = true;
+    }
 
-        return prediction + bias_;
+    FeatureHasher hasher() const
+    { return this->make_hasher({static_cast<size_t>(seed_)}, double_hashing_); }
+
+    /** Write the model to a snapshot, see `save_snapshot`. */
+    void save(SnapshotWriter& writer) const
+    {
+        SnapshotState state{log_num_buckets_, learning_rate_, bias_, seed_, double_hashing_};
+        writer.header(*this, SnapshotKind::perceptron_feature_hashing, Weight::snapshot_id, state);
+        writer.table(weights_);
+    }
+
+    /** Read a model from a snapshot, see `load_snapshot`. The weights stay
+     * in the snapshot. */
+    static PerceptronFeatureHashing load(SnapshotReader& reader)
+    {
+        PerceptronFeatureHashing clf;
+        auto state = reader.header<SnapshotState>(clf, SnapshotKind::perceptron_feature_hashing,
+                                                  Weight::snapshot_id);
+        clf.log_num_buckets_ = snapshot_log_num_buckets(state.log_num_buckets);
+        clf.learning_rate_ = state.learning_rate;
+        clf.bias_ = state.bias;
+        clf.seed_ = static_cast<int>(state.seed);
+        clf.double_hashing_ = state.double_hashing != 0;
+        clf.num_buckets_ = size_t{1} << clf.log_num_buckets_;
+        clf.bucket_mask_ = clf.num_buckets_ - 1;
+        clf.weights_ = reader.table<value_type>();
+        if (clf.weights_.size() != clf.num_buckets_ + Weight::padding)
+            throw std::runtime_error("model snapshot has a table of the wrong size");
+        return clf;
     }
 
     void print_weights() const
     {
         std::cout << "bias " << bias_ << std::endl;
-        for (size_t i = 0; i < weights_.size(); ++i)
+        for (size_t i = 0; i < num_buckets_; ++i)
         {
-            std::cout << "w" << i << " " << weights_[i] << std::endl;
+            std::cout << "w" << i << " " << Weight::value(weights_[i]) << std::endl;
         }
     }
 
 private:
-    size_t get_bucket(std::string_view ngram) const
-    { return get_bucket(hash(ngram, seed_)); }
+    static constexpr size_t SUM_BLOCK = 64;
+
+    /** The sum of the weights at `buckets`, `SUM_BLOCK` at a time, so that
+     * `predict_`, `predict_batch_` and `learn` give the same double. */
+    double sum_weights(const uint32_t *buckets, size_t n) const
+    {
+        double sum = 0.0;
+        for (size_t i = 0; i < n; i += SUM_BLOCK)
+            sum += Weight::sum(weights_.data(), buckets + i, std::min(SUM_BLOCK, n - i));
+        return sum;
+    }
+
+    /** The perceptron update, with `buckets` as scratch space. With
+     * `Shared`, other threads may update the model at the same time. */
+    template <bool Shared>
+    double learn(const HashedEmail &email, std::vector<uint32_t>& buckets)
+    {
+        // the buckets are computed once, for both the prediction and the
+        // update
+        buckets.clear();
+        get_buckets(email, buckets);
+
+        // w(n+1) = w(n) + l[d(n) - y(n)]x(n)
+        double bias = Shared ? detail::load_relaxed(bias_) : bias_;
+        double prediction = sum_weights(buckets.data(), buckets.size()) + bias;
+        int yn = signum(prediction);
+        int dn;
+        if (email.is_spam()) dn = 1;
+        else dn = -1;
+
+        int error = dn - yn;
+        if (error != 0)
+        {
+            for (uint32_t bucket : buckets)
+                add(weights_[bucket], learning_rate_ * error, Shared);
+            add_bias(learning_rate_ * error, Shared);
+        }
+        return prediction;
+    }
+
+    static void add(value_type& w, double delta, bool shared)
+    {
+        if (shared)
+            add_relaxed<Weight>(w, delta);
+        else
+            Weight::add(w, delta);
+    }
+
+    void add_bias(double delta, bool shared)
+    {
+        if (shared)
+            add_relaxed<DoubleWeight>(bias_, delta);
+        else
+            bias_ += delta;
+    }
+
+    /** Append the bucket of every n-gram of `email` to `buckets`. */
+    void get_buckets(const HashedEmail &email, std::vector<uint32_t>& buckets) const
+    {
+        for (size_t i = 0; i < email.num_ngrams(); ++i)
+            buckets.push_back(static_cast<uint32_t>(get_bucket(email.hash(i))));
+    }
 
     size_t get_bucket(size_t hash) const
     {
-        hash = hash % num_buckets_;
-        return hash;
+        // num_buckets_ is a power of two
+        return hash & bucket_mask_;
     }
 };
 
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#if defined(BDAP_PROFILE) && defined(__linux__)
+#define BDAP_PERF_EVENTS 1
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace bdap {
+
+/*
+ * Optional instrumentation of the hot paths. Code marks a phase with
+ * `BDAP_PHASE(name)`, which measures the rest of the enclosing scope. Only
+ * when compiled with `BDAP_PROFILE` (the CMake option of the same name) are
+ * the time and the number of calls of each phase counted, and on Linux also
+ * the cycles, cache misses and branch misses, through `perf_event_open`.
+ * Otherwise `BDAP_PHASE` expands to nothing.
+ *
+ * Phases can nest, e.g. `tokenize` within `parse`, and then the outer one
+ * includes the inner one. Each thread counts its own phases; `print_profile`
+ * reports their sum.
+ */
+
+enum class Phase {
+    parse,    // splitting a corpus into emails
+    tokenize, // finding the words of an email
+    hash,     // hashing the n-grams of an email
+    lookup,   // reading the count or weight tables for a batch of emails
+    score,    // predicting a window of emails, including its lookups
+    update,   // training on emails, and their predictions when prequential
+};
+
+constexpr size_t NUM_PHASES = 6;
+
+inline const char *phase_name(Phase phase)
+{
+    static const char *names[NUM_PHASES] = {"parse", "tokenize", "hash", "lookup", "score", "update"};
+    return names[static_cast<size_t>(phase)];
+}
+
+/** What is counted per phase. */
+struct PhaseCounters
+{
+    uint64_t calls = 0;
+    uint64_t nanoseconds = 0;
+    uint64_t cycles = 0;
+    uint64_t cache_misses = 0;
+    uint64_t branch_misses = 0;
+};
+
+#if defined(BDAP_PROFILE)
+
+namespace detail {
+
+/** The cycles, cache misses and branch misses of the calling thread, read
+ * together as one perf event group. Unavailable if the kernel does not
+ * allow it, e.g. in a container or with a high `perf_event_paranoid`. */
+class PerfCounters {
+    static constexpr int NUM_EVENTS = 3;
+    int fds_[NUM_EVENTS] = {-1, -1, -1};
+
+public:
+    PerfCounters()
+    {
+#if defined(BDAP_PERF_EVENTS)
+        const uint64_t configs[NUM_EVENTS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES,
+                                              PERF_COUNT_HW_BRANCH_MISSES};
+        for (int i = 0; i < NUM_EVENTS; ++i)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds_[i] = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1,
+                                                 i == 0 ? -1 : fds_[0], 0));
+            if (fds_[i] < 0)
+            {
+                close_all();
+                return;
+            }
+        }
+#endif
+    }
+
+    ~PerfCounters() { close_all(); }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available() const { return fds_[0] >= 0; }
+
+    /** Read the counters into `out`. False if they are unavailable. */
+    bool read(uint64_t out[NUM_EVENTS]) const
+    {
+#if defined(BDAP_PERF_EVENTS)
+        if (!available())
+            return false;
+        uint64_t buf[1 + NUM_EVENTS]; // the number of events, then their values
+        if (::read(fds_[0], buf, sizeof(buf)) != static_cast<ssize_t>(sizeof(buf)))
+            return false;
+        for (int i = 0; i < NUM_EVENTS; ++i)
+            out[i] = buf[1 + i];
+        return true;
+#else
+        (void)out;
+        return false;
+#endif
+    }
+
+private:
+    void close_all()
+    {
+#if defined(BDAP_PERF_EVENTS)
+        for (int& fd : fds_)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+};
+
+using ThreadPhases = std::array<PhaseCounters, NUM_PHASES>;
+
+/** The phase counters of all threads that ever entered a phase. They
+ * outlive their threads, so that worker threads are still reported. */
+class ProfileRegistry {
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<ThreadPhases>> threads_;
+
+public:
+    static ProfileRegistry& instance()
+    {
+        static ProfileRegistry registry;
+        return registry;
+    }
+
+    std::shared_ptr<ThreadPhases> add()
+    {
+        auto phases = std::make_shared<ThreadPhases>();
+        std::lock_guard<std::mutex> lock(mutex_);
+        threads_.push_back(phases);
+        return phases;
+    }
+
+    ThreadPhases total()
+    {
+        ThreadPhases sum{};
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& t : threads_)
+        {
+            for (size_t p = 0; p < NUM_PHASES; ++p)
+            {
+                sum[p].calls += (*t)[p].calls;
+                sum[p].nanoseconds += (*t)[p].nanoseconds;
+                sum[p].cycles += (*t)[p].cycles;
+                sum[p].cache_misses += (*t)[p].cache_misses;
+                sum[p].branch_misses += (*t)[p].branch_misses;
+            }
+        }
+        return sum;
+    }
+};
+
+inline ThreadPhases& thread_phases()
+{
+    thread_local std::shared_ptr<ThreadPhases> phases = ProfileRegistry::instance().add();
+    return *phases;
+}
+
+inline const PerfCounters& thread_perf_counters()
+{
+    thread_local PerfCounters counters;
+    return counters;
+}
+
+inline bool perf_counters_available()
+{ return thread_perf_counters().available(); }
+
+} // namespace detail
+
+/** Counts the time and hardware counters from its construction to its
+ * destruction towards `phase`. Use `BDAP_PHASE`. */
+class ScopedPhase {
+    PhaseCounters& counters_;
+    const detail::PerfCounters& perf_;
+    std::chrono::steady_clock::time_point begin_;
+    uint64_t perf_begin_[3];
+    bool has_perf_;
+
+public:
+    explicit ScopedPhase(Phase phase)
+        : counters_(detail::thread_phases()[static_cast<size_t>(phase)]),
+          perf_(detail::thread_perf_counters())
+    {
+        has_perf_ = perf_.read(perf_begin_);
+        begin_ = std::chrono::steady_clock::now();
+    }
+
+    ~ScopedPhase()
+    {
+        auto end = std::chrono::steady_clock::now();
+        uint64_t perf_end[3];
+        if (has_perf_ && perf_.read(perf_end))
+        {
+            counters_.cycles += perf_end[0] - perf_begin_[0];
+            counters_.cache_misses += perf_end[1] - perf_begin_[1];
+            counters_.branch_misses += perf_end[2] - perf_begin_[2];
+        }
+        ++counters_.calls;
+        counters_.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin_).count();
+    }
+
+    ScopedPhase(const ScopedPhase&) = delete;
+    ScopedPhase& operator=(const ScopedPhase&) = delete;
+};
+
+#define BDAP_PHASE_CONCAT_(a, b) a##b
+#define BDAP_PHASE_CONCAT(a, b) BDAP_PHASE_CONCAT_(a, b)
+#define BDAP_PHASE(phase) \
+    ::bdap::ScopedPhase BDAP_PHASE_CONCAT(bdap_phase_, __LINE__)(::bdap::Phase::phase)
+
+#else
+
+#define BDAP_PHASE(phase) ((void)0)
+
+#endif
+
+/** Print the counters of every phase, summed over all threads. Prints
+ * nothing unless compiled with `BDAP_PROFILE`. */
+inline void print_profile(std::ostream& os)
+{
+#if defined(BDAP_PROFILE)
+    detail::ThreadPhases total = detail::ProfileRegistry::instance().total();
+    bool perf = detail::perf_counters_available();
+
+    char line[160];
+    std::snprintf(line, sizeof(line), "%-10s %12s %12s %12s %14s %14s %14s",
+                  "phase", "calls", "ms", "ns/call", "cycles", "cache-misses", "branch-misses");
+    os << "------- Profile ------- " << '\n' << line << '\n';
+    for (size_t p = 0; p < NUM_PHASES; ++p)
+    {
+        const PhaseCounters& c = total[p];
+        if (c.calls == 0)
+            continue;
+        if (perf)
+            std::snprintf(line, sizeof(line), "%-10s %12llu %12.1f %12.1f %14llu %14llu %14llu",
+                          phase_name(static_cast<Phase>(p)), static_cast<unsigned long long>(c.calls),
+                          c.nanoseconds / 1e6, static_cast<double>(c.nanoseconds) / c.calls,
+                          static_cast<unsigned long long>(c.cycles),
+                          static_cast<unsigned long long>(c.cache_misses),
+                          static_cast<unsigned long long>(c.branch_misses));
+        else
+            std::snprintf(line, sizeof(line), "%-10s %12llu %12.1f %12.1f %14s %14s %14s",
+                          phase_name(static_cast<Phase>(p)), static_cast<unsigned long long>(c.calls),
+                          c.nanoseconds / 1e6, static_cast<double>(c.nanoseconds) / c.calls,
+                          "n/a", "n/a", "n/a");
+        os << line << '\n';
+    }
+    os << "(nested phases include each other: parse > tokenize, score > lookup)" << std::endl;
+#else
+    (void)os;
+#endif
+}
+
+} // namespace bdap
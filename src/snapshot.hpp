@@ -0,0 +1,250 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "binary_io.hpp"
+#include "mapped_file.hpp"
+#include "table.hpp"
+
+namespace bdap {
+
+/*
+ * Binary model snapshot format, written by `save_snapshot`.
+ *
+ * All integers are stored in native byte order, and every section starts at
+ * a multiple of 8 bytes:
+ *
+ *     SnapshotHeader
+ *     char     state[state_size]     // the classifier's `SnapshotState`
+ *     for each table of the classifier:
+ *         uint64_t size
+ *         T        data[size]
+ *
+ * `load_snapshot` of a file maps it copy-on-write and points the tables of
+ * the classifier into the mapping, so a large model is paged in as it is
+ * used rather than read up front, and it can still be updated.
+ */
+
+constexpr char SNAPSHOT_MAGIC[8] = {'B', 'D', 'A', 'P', 'M', 'D', 'L', '\0'};
+constexpr uint32_t SNAPSHOT_VERSION = 3;
+
+/** The classifier a snapshot was taken of. */
+enum class SnapshotKind : uint32_t {
+    naive_bayes_feature_hashing = 1,
+    naive_bayes_count_min = 2,
+    perceptron_feature_hashing = 3,
+    perceptron_count_min = 4,
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t kind;        // SnapshotKind
+    uint32_t value_id;    // `snapshot_id` of the counter or weight type
+    uint32_t reserved;
+    uint64_t state_size;
+
+    // the parameters of `BaseClf`
+    int64_t num_examples_processed;
+    int64_t ngram_k;
+    double threshold;
+    uint64_t compositional_ngrams;
+};
+
+static_assert(sizeof(SnapshotHeader) % 8 == 0, "sections must stay aligned");
+
+class SnapshotWriter {
+    std::ostream& os_;
+
+public:
+    explicit SnapshotWriter(std::ostream& os) : os_(os) {}
+
+    /** Write the header, with the parameters of `BaseClf`, and the
+     * classifier specific `state`. */
+    template <typename Clf, typename State>
+    void header(const Clf& clf, SnapshotKind kind, uint32_t value_id, const State& state)
+    {
+        SnapshotHeader header{};
+        std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.kind = static_cast<uint32_t>(kind);
+        header.value_id = value_id;
+        header.state_size = sizeof(State);
+        header.num_examples_processed = clf.num_examples_processed;
+        header.ngram_k = clf.ngram_k;
+        header.threshold = clf.threshold;
+        header.compositional_ngrams = clf.compositional_ngrams;
+
+        os_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        detail::write_section(os_, &state, 1);
+    }
+
+    template <typename T>
+    void table(const T *data, size_t size)
+    {
+        uint64_t n = size;
+        detail::write_section(os_, &n, 1);
+        detail::write_section(os_, data, size);
+    }
+
+    template <typename T>
+    void table(const Table<T>& t) { table(t.data(), t.size()); }
+
+    template <typename T>
+    void table(const std::vector<T>& v) { table(v.data(), v.size()); }
+};
+
+/*
+ * Checks of the classifier state read from a snapshot, so that a corrupt
+ * file throws `std::runtime_error` instead of leading to undefined shifts
+ * or out-of-bounds table accesses.
+ */
+
+/** `log_num_buckets` if it is at most 40, so that the table sizes derived
+ * from it cannot overflow. */
+inline int snapshot_log_num_buckets(int64_t log_num_buckets)
+{
+    if (log_num_buckets < 0 || log_num_buckets > 40)
+        throw std::runtime_error("model snapshot has an invalid number of buckets");
+    return static_cast<int>(log_num_buckets);
+}
+
+/** `num_hashes` if it is a sane number of Count-Min rows. */
+inline int snapshot_num_hashes(int64_t num_hashes)
+{
+    if (num_hashes < 1 || num_hashes > (1 << 16))
+        throw std::runtime_error("model snapshot has an invalid number of hashes");
+    return static_cast<int>(num_hashes);
+}
+
+/** Check that the strides of a Naive Bayes count table of `class_size`
+ * buckets per class are those of a `BucketLayout`. */
+inline void check_snapshot_strides(size_t bucket_stride, size_t class_stride, size_t class_size)
+{
+    bool by_class = bucket_stride == 1 && class_stride == class_size;
+    bool interleaved = bucket_stride == 2 && class_stride == 1;
+    if (!by_class && !interleaved)
+        throw std::runtime_error("model snapshot has an invalid bucket layout");
+}
+
+class SnapshotReader {
+    char *data_;
+    size_t size_;
+    size_t pos_ = 0;
+    std::shared_ptr<const void> storage_;
+
+public:
+    /** Read the snapshot at `data`, which must be writable, 8-byte aligned,
+     * and owned by `storage`. */
+    SnapshotReader(char *data, size_t size, std::shared_ptr<const void> storage)
+        : data_(data), size_(size), storage_(std::move(storage)) {}
+
+    /** Check that the snapshot is of the expected classifier, restore the
+     * parameters of `BaseClf` in `clf`, and return the classifier specific
+     * state. */
+    template <typename State, typename Clf>
+    State header(Clf& clf, SnapshotKind kind, uint32_t value_id)
+    {
+        if (size_ < sizeof(SnapshotHeader)
+                || std::memcmp(data_, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+            throw std::runtime_error("not a model snapshot");
+
+        SnapshotHeader header;
+        std::memcpy(&header, data_, sizeof(header));
+        if (header.version != SNAPSHOT_VERSION)
+            throw std::runtime_error("unsupported model snapshot version");
+        if (header.kind != static_cast<uint32_t>(kind) || header.value_id != value_id
+                || header.state_size != sizeof(State))
+            throw std::runtime_error("model snapshot is of a different classifier");
+
+        clf.num_examples_processed = static_cast<int>(header.num_examples_processed);
+        clf.ngram_k = static_cast<int>(header.ngram_k);
+        clf.threshold = header.threshold;
+        clf.compositional_ngrams = header.compositional_ngrams != 0;
+
+        pos_ = sizeof(header);
+        State state;
+        std::memcpy(&state, detail::read_section<State>(view(), pos_, 1), sizeof(state));
+        return state;
+    }
+
+    /** The next table, as a view into the snapshot. */
+    template <typename T>
+    Table<T> table()
+    {
+        size_t n = *detail::read_section<uint64_t>(view(), pos_, 1);
+        const T *p = detail::read_section<T>(view(), pos_, n);
+        return Table<T>(const_cast<T *>(p), n, storage_);
+    }
+
+    /** The next table, as a copy. */
+    template <typename T>
+    std::vector<T> vector()
+    {
+        size_t n = *detail::read_section<uint64_t>(view(), pos_, 1);
+        const T *p = detail::read_section<T>(view(), pos_, n);
+        return std::vector<T>(p, p + n);
+    }
+
+private:
+    std::string_view view() const { return {data_, size_}; }
+};
+
+/**
+ * Write a snapshot of `clf`, which must implement
+ * `void save(SnapshotWriter&) const`.
+ */
+template <typename Clf>
+void save_snapshot(std::ostream& os, const Clf& clf)
+{
+    SnapshotWriter writer(os);
+    clf.save(writer);
+    if (!os)
+        throw std::runtime_error("failed to write model snapshot");
+}
+
+template <typename Clf>
+void save_snapshot(const std::string& fname, const Clf& clf)
+{
+    std::ofstream os(fname, std::ios::binary);
+    if (!os.is_open())
+        throw std::runtime_error("cannot open " + fname);
+    save_snapshot(os, clf);
+}
+
+/**
+ * Load a classifier of type `Clf`, which must implement
+ * `static Clf load(SnapshotReader&)`, from the snapshot in `is`. The
+ * snapshot is read into memory once, and the tables of the classifier
+ * point into it.
+ */
+template <typename Clf>
+Clf load_snapshot(std::istream& is)
+{
+    std::string bytes{std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>()};
+    auto buffer = std::make_shared<std::vector<uint64_t>>(detail::align8(bytes.size()) / 8);
+    std::memcpy(buffer->data(), bytes.data(), bytes.size());
+    SnapshotReader reader(reinterpret_cast<char *>(buffer->data()), bytes.size(), buffer);
+    return Clf::load(reader);
+}
+
+/** As above, but the file is mapped into memory copy-on-write, so loading
+ * does not read the tables. */
+template <typename Clf>
+Clf load_snapshot(const std::string& fname)
+{
+    auto file = std::make_shared<MappedFile>(fname, MappedFile::copy_on_write);
+    SnapshotReader reader(file->mutable_data(), file->size(), file);
+    return Clf::load(reader);
+}
+
+} // namespace bdap
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace bdap {
+
+/**
+ * A non-owning view of a contiguous range of `T`s, like C++20's `std::span`
+ * (this code base is C++17).
+ */
+template <typename T>
+class span {
+    T *data_;
+    size_t size_;
+
+public:
+    span() : data_(nullptr), size_(0) {}
+    span(T *data, size_t size) : data_(data), size_(size) {}
+    span(std::vector<std::remove_const_t<T>>& v) : data_(v.data()), size_(v.size()) {}
+
+    template <typename U = T, typename = std::enable_if_t<std::is_const_v<U>>>
+    span(const std::vector<std::remove_const_t<T>>& v) : data_(v.data()), size_(v.size()) {}
+
+    T *data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    T& operator[](size_t i) const { return data_[i]; }
+    T *begin() const { return data_; }
+    T *end() const { return data_ + size_; }
+
+    span subspan(size_t offset, size_t count) const
+    { return span(data_ + offset, count); }
+};
+
+} // namespace bdap
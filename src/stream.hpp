@@ -0,0 +1,290 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "email.hpp"
+#include "email_stream.hpp"
+#include "hashed_email.hpp"
+#include "parallel.hpp"
+#include "profile.hpp"
+#include "span.hpp"
+
+namespace bdap {
+
+/** Accuracy, precision and recall after every window of a stream. */
+using StreamCurves = std::tuple<std::vector<double>,std::vector<double>,std::vector<double>>;
+
+/** A classifier together with the metric that tracks it in a stream. */
+template <typename Clf, typename Metric>
+struct StreamModel
+{
+    Clf& clf;
+    Metric& metric;
+};
+
+template <typename Clf, typename Metric>
+StreamModel<Clf, Metric> stream_model(Clf& clf, Metric& metric)
+{ return {clf, metric}; }
+
+/** Tag to stream prequentially: every email is predicted by the model that
+ * has seen all emails before it, and that prediction is reused for the
+ * update (see `BaseClf::learn_one`). */
+struct Prequential {};
+inline constexpr Prequential prequential{};
+
+namespace detail {
+
+/** Does `Metric` have an `end_window()` hook, see
+ * `MultiThresholdAccuracy`? */
+template <typename Metric, typename = void>
+struct has_end_window : std::false_type {};
+
+template <typename Metric>
+struct has_end_window<Metric, std::void_t<decltype(std::declval<Metric&>().end_window())>>
+    : std::true_type {};
+
+/**
+ * Evaluate the window against the model as it is before the window's updates.
+ * The window is scored with one batched prediction. With a thread pool, it is
+ * split in contiguous parts that are scored concurrently into partial
+ * metrics, which are then merged in order.
+ */
+template <typename Model>
+void evaluate_window(Model& model, const std::vector<HashedEmail>& hashed, ThreadPool *pool)
+{
+    BDAP_PHASE(score);
+    std::vector<double> scores(hashed.size());
+    if (pool == nullptr || pool->size() == 1 || hashed.size() < 2)
+    {
+        model.clf.predict_batch(hashed, scores);
+        for (size_t u = 0; u < hashed.size(); ++u)
+            model.metric.record(model.clf, hashed[u].is_spam(), scores[u]);
+        return;
+    }
+
+    using Metric = std::remove_reference_t<decltype(model.metric)>;
+    size_t num_parts = std::min(pool->size(), hashed.size());
+    std::vector<Metric> partial(num_parts, model.metric);
+    pool->parallel_for(num_parts, [&](size_t p) {
+        partial[p].reset();
+        size_t begin = p * hashed.size() / num_parts;
+        size_t end = (p+1) * hashed.size() / num_parts;
+        model.clf.predict_batch(span<const HashedEmail>(hashed).subspan(begin, end-begin),
+                                span<double>(scores).subspan(begin, end-begin));
+        for (size_t u = begin; u < end; ++u)
+            partial[p].record(model.clf, hashed[u].is_spam(), scores[u]);
+    });
+    for (const Metric& m : partial)
+        model.metric.merge(m);
+}
+
+template <typename Model>
+void stream_window(Model& model, const std::vector<HashedEmail>& hashed, StreamCurves& curves,
+                   ThreadPool *pool, bool prequential)
+{
+    if (prequential)
+    {
+        BDAP_PHASE(update);
+        for (const HashedEmail& email : hashed)
+            model.metric.evaluate_and_learn(model.clf, email);
+    }
+    else
+    {
+        evaluate_window(model, hashed, pool);
+    }
+
+    std::get<0>(curves).push_back(model.metric.get_score());
+    std::get<1>(curves).push_back(model.metric.get_precision());
+    std::get<2>(curves).push_back(model.metric.get_recall());
+    if constexpr (has_end_window<std::remove_reference_t<decltype(model.metric)>>::value)
+        model.metric.end_window();
+
+    if (!prequential)
+    {
+        BDAP_PHASE(update);
+        for (const HashedEmail& email : hashed)
+            model.clf.update(email);
+    }
+}
+
+/** The emails of a vector, a window at a time, like `EmailStream`. */
+class VectorStream {
+    const std::vector<Email>& emails_;
+    size_t pos_ = 0;
+
+public:
+    explicit VectorStream(const std::vector<Email>& emails) : emails_(emails) {}
+
+    span<const Email> next(size_t n)
+    {
+        n = std::min(n, emails_.size() - pos_);
+        span<const Email> out = span<const Email>(emails_).subspan(pos_, n);
+        pos_ += n;
+        return out;
+    }
+};
+
+template <typename Emails, typename... Models, size_t... I>
+std::array<StreamCurves, sizeof...(Models)>
+stream_emails(Emails& emails, int window, ThreadPool *pool, bool prequential,
+              std::tuple<Models...>& models, std::index_sequence<I...>)
+{
+    constexpr size_t N = sizeof...(Models);
+    std::array<FeatureHasher, N> hashers = {std::get<I>(models).clf.hasher()...};
+
+    // models with the same hasher share the hashed emails of the first one
+    std::array<size_t, N> source;
+    for (size_t m = 0; m < N; ++m)
+    {
+        source[m] = m;
+        for (size_t j = 0; j < m && source[m] == m; ++j)
+            if (hashers[j] == hashers[m])
+                source[m] = j;
+    }
+
+    std::array<StreamCurves, N> curves;
+    std::array<std::vector<HashedEmail>, N> hashed;
+    for (span<const Email> batch = emails.next(window); !batch.empty(); batch = emails.next(window))
+    {
+        // hash every email of the window once, for both evaluation and update
+        for (size_t m = 0; m < N; ++m)
+        {
+            if (source[m] != m)
+                continue;
+            hashed[m].clear();
+            for (const Email& email : batch)
+                hashed[m].emplace_back(email, hashers[m]);
+        }
+
+        (stream_window(std::get<I>(models), hashed[source[I]], curves[I], pool, prequential), ...);
+    }
+    return curves;
+}
+
+} // namespace detail
+
+/**
+ * Like below, but for any number of models at once, e.g.
+ *
+ * ```
+ *     stream_emails(emails, window, stream_model(clf1, metric1),
+ *                                   stream_model(clf2, metric2));
+ * ```
+ *
+ * All models see the stream in lockstep in a single pass over the emails.
+ * The n-grams of each email are hashed once for all models that use the same
+ * `FeatureHasher`. Returns the curves of the models in the given order.
+ */
+template <typename... Clfs, typename... Metrics>
+std::array<StreamCurves, sizeof...(Clfs)>
+stream_emails(const std::vector<Email> &emails, int window,
+              StreamModel<Clfs, Metrics>... models)
+{
+    std::tuple<StreamModel<Clfs, Metrics>...> ms{models...};
+    detail::VectorStream stream(emails);
+    return detail::stream_emails(stream, window, nullptr, false, ms,
+                                 std::index_sequence_for<Clfs...>{});
+}
+
+/**
+ * As above, but the emails of each window are scored concurrently on `pool`.
+ * The model does not change while a window is evaluated, so the metrics are
+ * exactly those of the serial version.
+ */
+template <typename... Clfs, typename... Metrics>
+std::array<StreamCurves, sizeof...(Clfs)>
+stream_emails(const std::vector<Email> &emails, int window, ThreadPool& pool,
+              StreamModel<Clfs, Metrics>... models)
+{
+    std::tuple<StreamModel<Clfs, Metrics>...> ms{models...};
+    detail::VectorStream stream(emails);
+    return detail::stream_emails(stream, window, &pool, false, ms,
+                                 std::index_sequence_for<Clfs...>{});
+}
+
+/**
+ * As above, but prequential (test-then-train): every email is scored by the
+ * model trained on all emails before it, and is then learned from with the
+ * same traversal. The curves are still recorded every `window` emails.
+ * Scoring depends on the previous update, so it is not parallelized.
+ */
+template <typename... Clfs, typename... Metrics>
+std::array<StreamCurves, sizeof...(Clfs)>
+stream_emails(const std::vector<Email> &emails, int window, Prequential,
+              StreamModel<Clfs, Metrics>... models)
+{
+    std::tuple<StreamModel<Clfs, Metrics>...> ms{models...};
+    detail::VectorStream stream(emails);
+    return detail::stream_emails(stream, window, nullptr, true, ms,
+                                 std::index_sequence_for<Clfs...>{});
+}
+
+/**
+ * As the overloads above, but the emails are read from `emails` as they are
+ * needed instead of being loaded up front, so memory stays bounded however
+ * long the stream is.
+ */
+template <typename... Clfs, typename... Metrics>
+std::array<StreamCurves, sizeof...(Clfs)>
+stream_emails(EmailStream &emails, int window,
+              StreamModel<Clfs, Metrics>... models)
+{
+    std::tuple<StreamModel<Clfs, Metrics>...> ms{models...};
+    return detail::stream_emails(emails, window, nullptr, false, ms,
+                                 std::index_sequence_for<Clfs...>{});
+}
+
+template <typename... Clfs, typename... Metrics>
+std::array<StreamCurves, sizeof...(Clfs)>
+stream_emails(EmailStream &emails, int window, ThreadPool& pool,
+              StreamModel<Clfs, Metrics>... models)
+{
+    std::tuple<StreamModel<Clfs, Metrics>...> ms{models...};
+    return detail::stream_emails(emails, window, &pool, false, ms,
+                                 std::index_sequence_for<Clfs...>{});
+}
+
+template <typename... Clfs, typename... Metrics>
+std::array<StreamCurves, sizeof...(Clfs)>
+stream_emails(EmailStream &emails, int window, Prequential,
+              StreamModel<Clfs, Metrics>... models)
+{
+    std::tuple<StreamModel<Clfs, Metrics>...> ms{models...};
+    return detail::stream_emails(emails, window, nullptr, true, ms,
+                                 std::index_sequence_for<Clfs...>{});
+}
+
+/**
+ * This function emulates a stream of emails. Every `window` examples, the
+ * metric is evaluated and the score is recorded. Use the results of this
+ * function to plot your learning curves.
+ */
+template <typename Clf, typename Metric>
+StreamCurves
+stream_emails(const std::vector<Email> &emails,
+              Clf& clf, Metric& metric, int window)
+{
+    return stream_emails(emails, window, stream_model(clf, metric))[0];
+}
+
+template <typename Clf, typename Metric>
+StreamCurves
+stream_emails(const std::vector<Email> &emails,
+              Clf& clf, Metric& metric, int window, ThreadPool& pool)
+{
+    return stream_emails(emails, window, pool, stream_model(clf, metric))[0];
+}
+
+template <typename Clf, typename Metric>
+StreamCurves
+stream_emails(const std::vector<Email> &emails,
+              Clf& clf, Metric& metric, int window, Prequential)
+{
+    return stream_emails(emails, window, prequential, stream_model(clf, metric))[0];
+}
+
+} // namespace bdap
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <chrono>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "email.hpp"
+#include "metric.hpp"
+#include "parallel.hpp"
+#include "stream.hpp"
+
+#include "naive_bayes_feature_hashing.hpp"
+#include "perceptron_feature_hashing.hpp"
+#include "naive_bayes_count_min.hpp"
+#include "perceptron_count_min.hpp"
+
+namespace bdap {
+
+/** The names of the classifiers a sweep can run. */
+const std::vector<std::string> SWEEP_CLASSIFIERS = {
+    "nb-hashing", "nb-countmin", "perceptron-hashing", "perceptron-countmin"};
+
+/** The names of the counter types of the Naive Bayes classifiers, see
+ * `counters.hpp`. */
+const std::vector<std::string> SWEEP_COUNTERS = {"int32", "int16", "int8", "morris8"};
+
+/** The names of the weight types of the perceptrons, see `weights.hpp`. */
+const std::vector<std::string> SWEEP_WEIGHTS = {"double", "float", "int16"};
+
+/** How a sweep streams the emails, see `stream_emails`. */
+const std::vector<std::string> SWEEP_MODES = {"windowed", "prequential"};
+
+/** One configuration of a hyperparameter sweep. */
+struct SweepConfig
+{
+    std::string clf;
+    std::string mode;
+    int window;
+    int ngram_k;
+    int log_num_buckets;
+    int num_hashes;        // Count-Min only
+    std::vector<double> thresholds; // Naive Bayes only, all evaluated in one pass
+    double learning_rate;  // perceptron only
+    std::string counter;   // Naive Bayes only
+    std::string weights;   // perceptron only
+    bool conservative;     // Naive Bayes Count-Min only
+};
+
+/** The values to sweep for every hyperparameter. */
+struct SweepGrid
+{
+    std::vector<std::string> clfs = SWEEP_CLASSIFIERS;
+    std::vector<std::string> modes = {"windowed"};
+    std::vector<int> windows = {100};
+    std::vector<int> ngram_ks = {3};
+    std::vector<int> log_num_buckets = {17};
+    std::vector<int> num_hashes = {3};
+    std::vector<double> thresholds = {0.5};
+    std::vector<double> learning_rates = {0.8};
+    std::vector<std::string> counters = {"int32"};
+    std::vector<std::string> weights = {"double"};
+    std::vector<int> conservative = {0};
+
+    /** The cartesian product of the grid. Hyperparameters that do not
+     * apply to a classifier are not swept for it. The thresholds are not
+     * part of the product: every configuration evaluates all of them on the
+     * same stream, see `MultiThresholdAccuracy`. */
+    std::vector<SweepConfig> configs() const
+    {
+        std::vector<SweepConfig> out;
+        for (const std::string& clf : clfs)
+        {
+            bool naive_bayes = clf.rfind("nb-", 0) == 0;
+            bool count_min = clf.find("countmin") != std::string::npos;
+            std::vector<int> hs = count_min ? num_hashes : std::vector<int>{1};
+            std::vector<double> ts = naive_bayes ? thresholds : std::vector<double>{0.0};
+            std::vector<double> lrs = naive_bayes ? std::vector<double>{0.0} : learning_rates;
+            std::vector<std::string> cs = naive_bayes ? counters : std::vector<std::string>{""};
+            std::vector<std::string> ws = naive_bayes ? std::vector<std::string>{""} : weights;
+            std::vector<int> cus = naive_bayes && count_min ? conservative : std::vector<int>{0};
+
+            for (const std::string& m : modes)
+            for (int w : windows)
+            for (int k : ngram_ks)
+            for (int b : log_num_buckets)
+            for (int h : hs)
+            for (double lr : lrs)
+            for (const std::string& c : cs)
+            for (const std::string& wt : ws)
+            for (int cu : cus)
+                out.push_back({clf, m, w, k, b, h, ts, lr, c, wt, cu != 0});
+        }
+        return out;
+    }
+};
+
+template <typename Clf>
+struct is_naive_bayes_count_min : std::false_type {};
+
+template <typename Counter, int NumHashes>
+struct is_naive_bayes_count_min<NaiveBayesCountMin<Counter, NumHashes>> : std::true_type {};
+
+struct SweepResult
+{
+    SweepConfig config;
+    ThresholdCurves curves;
+    std::vector<double> auc;
+    double seconds;
+    double saturated = 0.0; // fraction of lost counter increments, Naive Bayes only
+};
+
+/**
+ * The metric of a sweep: the accuracy, precision and recall at every
+ * threshold of the configuration, and a `ScoreHistogram` of the same scores
+ * for the AUC.
+ */
+struct SweepMetric
+{
+    MultiThresholdAccuracy accuracy;
+    ScoreHistogram histogram;
+
+    template<typename Clf, typename E>
+    void evaluate_and_learn(Clf &clf, const E &email)
+    { record(clf, email.is_spam(), clf.learn_one(email)); }
+
+    template<typename Clf>
+    void record(const Clf &clf, bool lab, double pr)
+    {
+        accuracy.record(clf, lab, pr);
+        histogram.record(clf, lab, pr);
+    }
+
+    void merge(const SweepMetric &o)
+    {
+        accuracy.merge(o.accuracy);
+        histogram.merge(o.histogram);
+    }
+
+    void reset()
+    {
+        accuracy.reset();
+        histogram.reset();
+    }
+
+    void end_window()
+    {
+        accuracy.end_window();
+        histogram.end_window();
+    }
+
+    double get_score() const
+    { return accuracy.get_score(); }
+
+    double get_precision() const
+    { return accuracy.get_precision(); }
+
+    double get_recall() const
+    { return accuracy.get_recall(); }
+};
+
+template <typename Clf>
+void run_sweep_config(const std::vector<Email>& emails, Clf& clf, SweepResult& result)
+{
+    clf.ngram_k = result.config.ngram_k;
+    clf.compositional_ngrams = true;
+    if constexpr (is_naive_bayes_count_min<Clf>::value)
+        clf.conservative_update = result.config.conservative;
+
+    // the Naive Bayes models predict a posterior, the perceptrons a margin
+    bool naive_bayes = result.config.clf.rfind("nb-", 0) == 0;
+    SweepMetric metric{MultiThresholdAccuracy(result.config.thresholds),
+                       naive_bayes ? ScoreHistogram::for_probabilities()
+                                   : ScoreHistogram::for_margins()};
+    auto begin = std::chrono::steady_clock::now();
+    if (result.config.mode == "prequential")
+        stream_emails(emails, clf, metric, result.config.window, prequential);
+    else
+        stream_emails(emails, clf, metric, result.config.window);
+    auto end = std::chrono::steady_clock::now();
+    result.seconds = std::chrono::duration<double>(end - begin).count();
+    result.curves = metric.accuracy.curves();
+    result.auc = metric.histogram.auc_curve();
+}
+
+/** A type as a value, to pass types to generic lambdas. */
+template <typename T>
+struct TypeTag { using type = T; };
+
+/** Call `f(TypeTag<Counter>{})` with the counter type named `counter`. */
+template <typename F>
+void dispatch_counter(const std::string& counter, F&& f)
+{
+    if (counter == "int32") f(TypeTag<Counter32>{});
+    else if (counter == "int16") f(TypeTag<Counter16>{});
+    else if (counter == "int8") f(TypeTag<Counter8>{});
+    else if (counter == "morris8") f(TypeTag<MorrisCounter8>{});
+    else throw std::invalid_argument("unknown counter " + counter);
+}
+
+/** Call `f(TypeTag<Weight>{})` with the weight type named `weights`. */
+template <typename F>
+void dispatch_weights(const std::string& weights, F&& f)
+{
+    if (weights == "double") f(TypeTag<DoubleWeight>{});
+    else if (weights == "float") f(TypeTag<FloatWeight>{});
+    else if (weights == "int16") f(TypeTag<Fixed16Weight>{});
+    else throw std::invalid_argument("unknown weights " + weights);
+}
+
+/** Call `f(std::integral_constant<int, N>{})` with `N` the number of
+ * Count-Min rows to instantiate for `num_hashes`: `num_hashes` itself if
+ * there is a specialized kernel for it, else `DYNAMIC_ROWS`. */
+template <typename F>
+void dispatch_num_hashes(int num_hashes, F&& f)
+{
+    switch (num_hashes)
+    {
+    case 3: f(std::integral_constant<int, 3>{}); break;
+    case 5: f(std::integral_constant<int, 5>{}); break;
+    case 7: f(std::integral_constant<int, 7>{}); break;
+    default: f(std::integral_constant<int, DYNAMIC_ROWS>{}); break;
+    }
+}
+
+template <typename Clf>
+void record_saturation(const Clf& clf, SweepResult& result)
+{
+    if (clf.num_increments() > 0)
+        result.saturated = static_cast<double>(clf.num_saturated()) / clf.num_increments();
+}
+
+inline void run_sweep_config(const std::vector<Email>& emails, SweepResult& result)
+{
+    const SweepConfig& c = result.config;
+    if (c.clf == "nb-hashing")
+    {
+        dispatch_counter(c.counter, [&](auto counter) {
+            using Counter = typename decltype(counter)::type;
+            NaiveBayesFeatureHashing<Counter> clf{c.log_num_buckets, c.thresholds.front(),
+                                                  BucketLayout::interleaved};
+            run_sweep_config(emails, clf, result);
+            record_saturation(clf, result);
+        });
+    }
+    else if (c.clf == "nb-countmin")
+    {
+        dispatch_counter(c.counter, [&](auto counter) {
+            dispatch_num_hashes(c.num_hashes, [&](auto num_hashes) {
+                using Counter = typename decltype(counter)::type;
+                constexpr int H = decltype(num_hashes)::value;
+                NaiveBayesCountMin<Counter, H> clf{c.num_hashes, c.log_num_buckets, c.thresholds.front(),
+                                                   true, BucketLayout::interleaved};
+                run_sweep_config(emails, clf, result);
+                record_saturation(clf, result);
+            });
+        });
+    }
+    else if (c.clf == "perceptron-hashing")
+    {
+        dispatch_weights(c.weights, [&](auto weights) {
+            using Weight = typename decltype(weights)::type;
+            PerceptronFeatureHashing<Weight> clf{c.log_num_buckets, c.learning_rate};
+            run_sweep_config(emails, clf, result);
+        });
+    }
+    else if (c.clf == "perceptron-countmin")
+    {
+        dispatch_weights(c.weights, [&](auto weights) {
+            dispatch_num_hashes(c.num_hashes, [&](auto num_hashes) {
+                using Weight = typename decltype(weights)::type;
+                constexpr int H = decltype(num_hashes)::value;
+                PerceptronCountMin<Weight, H> clf{c.num_hashes, c.log_num_buckets,
+                                                  c.learning_rate, true};
+                run_sweep_config(emails, clf, result);
+            });
+        });
+    }
+    else
+    {
+        throw std::invalid_argument("unknown classifier " + c.clf);
+    }
+}
+
+/**
+ * Stream `emails` through a fresh classifier for every configuration. The
+ * configurations run concurrently on `num_threads` threads; the emails are
+ * shared read-only between them.
+ */
+inline std::vector<SweepResult> run_sweep(const std::vector<Email>& emails,
+                                          const std::vector<SweepConfig>& configs,
+                                          size_t num_threads)
+{
+    std::vector<SweepResult> results(configs.size());
+    for (size_t i = 0; i < configs.size(); ++i)
+        results[i].config = configs[i];
+
+    parallel_for(results.size(), num_threads, [&](size_t i) {
+        run_sweep_config(emails, results[i]);
+    });
+    return results;
+}
+
+/** Write the learning curves of all configurations as one CSV table, with a
+ * row per configuration, evaluation step and threshold. */
+inline void write_sweep_csv(std::ostream& os, const std::vector<SweepResult>& results)
+{
+    os << "clf,mode,window,ngram_k,log_num_buckets,num_hashes,learning_rate,counter,weights,conservative,"
+       << "saturated,seconds,step,threshold,accuracy,precision,recall,auc\n";
+    for (const SweepResult& r : results)
+    {
+        const SweepConfig& c = r.config;
+        for (size_t w = 0; w < r.curves.num_windows(); ++w)
+        {
+            for (size_t i = 0; i < r.curves.thresholds.size(); ++i)
+            {
+                os << c.clf << ',' << c.mode << ',' << c.window << ',' << c.ngram_k << ','
+                   << c.log_num_buckets << ',' << c.num_hashes << ','
+                   << c.learning_rate << ',' << c.counter << ',' << c.weights << ',' << c.conservative << ','
+                   << r.saturated << ',' << r.seconds << ',';
+                r.curves.write_csv_row(os, w, i);
+                os << ',' << r.auc[w] << '\n';
+            }
+        }
+    }
+}
+
+} // namespace bdap
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace bdap {
+
+/**
+ * A flat array of `T` for the count and weight tables of the classifiers.
+ * It either owns its elements, or views elements that are kept alive by
+ * `storage`, e.g. a model snapshot mapped into memory (see `snapshot.hpp`).
+ * A view is writable if its memory is, so a model loaded from a snapshot
+ * can keep learning.
+ *
+ * Copies always own their elements.
+ */
+template <typename T>
+class Table {
+    std::vector<T> owned_;
+    std::shared_ptr<const void> storage_;
+    T *data_ = nullptr;
+    size_t size_ = 0;
+
+public:
+    Table() = default;
+
+    Table(size_t size, const T& value)
+        : owned_(size, value), data_(owned_.data()), size_(size) {}
+
+    /** A view of `size` elements at `data`, which is owned by `storage`. */
+    Table(T *data, size_t size, std::shared_ptr<const void> storage)
+        : storage_(std::move(storage)), data_(data), size_(size) {}
+
+    Table(const Table& o)
+        : owned_(o.begin(), o.end()), data_(owned_.data()), size_(o.size_) {}
+
+    Table(Table&& o) noexcept
+        : owned_(std::move(o.owned_)), storage_(std::move(o.storage_)),
+          data_(o.data_), size_(o.size_)
+    {
+        o.data_ = nullptr;
+        o.size_ = 0;
+    }
+
+    Table& operator=(Table o) noexcept
+    {
+        std::swap(owned_, o.owned_);
+        std::swap(storage_, o.storage_);
+        std::swap(data_, o.data_);
+        std::swap(size_, o.size_);
+        return *this;
+    }
+
+    T& operator[](size_t i) { return data_[i]; }
+    const T& operator[](size_t i) const { return data_[i]; }
+
+    T *data() { return data_; }
+    const T *data() const { return data_; }
+    size_t size() const { return size_; }
+
+    T *begin() { return data_; }
+    T *end() { return data_ + size_; }
+    const T *begin() const { return data_; }
+    const T *end() const { return data_ + size_; }
+
+    /** Does this table view memory it does not own? */
+    bool is_view() const { return storage_ != nullptr; }
+};
+
+} // namespace bdap
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BDAP_AVX2_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace bdap {
+
+/*
+ * Weight types for the perceptrons. A weight type defines
+ *  - `value_type`: what is stored per bucket,
+ *  - `padding`: how many elements the weight table needs past its end,
+ *  - `add(w, delta)`: add `delta` to the weight `w`,
+ *  - `value(w)`: the weight that `w` represents,
+ *  - `sum(w, idx, n)`: the sum of the weights `w[idx[0..n)]`,
+ *  - `gather(w, idx, n, out)`: `out[i] = value(w[idx[i]])` for `i < n`,
+ *  - `resolution`: the smallest nonzero step `add` can take, 0 if any,
+ *  - `snapshot_id`: identifies the weight type in model snapshots.
+ * The index arrays are computed up front so that `sum` and `gather` can
+ * load many weights at once. On x86 they use AVX2 gathers if the CPU has
+ * them.
+ *
+ * The indices are stored in 32 bits, but the AVX2 gathers read them as
+ * signed offsets, so a weight table holds at most 2^31 weights.
+ */
+
+/** Throws `std::length_error` if a table of `size` weights cannot be
+ * indexed with non-negative 32-bit signed indices. */
+inline void check_bucket_index_range(size_t size)
+{
+    if (size > (size_t{1} << 31))
+        throw std::length_error("weight table too large for 32-bit bucket indices");
+}
+
+/** Throws `std::invalid_argument` if a perceptron update of `Weight`, which
+ * is `2 * learning_rate` in either direction, would be smaller than one step
+ * of the weight type and so be rounded away. */
+template <typename Weight>
+void check_learning_rate(double learning_rate)
+{
+    if (!(learning_rate > 0.0) || 2.0 * learning_rate < Weight::resolution)
+        throw std::invalid_argument("learning rate too small for the weight type");
+}
+
+namespace detail {
+
+#if defined(BDAP_AVX2_KERNELS)
+inline bool has_avx2()
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+__attribute__((target("avx2")))
+inline double hsum(__m256d v)
+{
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+__attribute__((target("avx2")))
+inline double sum_float_avx2(const float *w, const uint32_t *idx, size_t n)
+{
+    __m256d lo = _mm256_setzero_pd();
+    __m256d hi = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i vidx = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx + i));
+        __m256 v = _mm256_i32gather_ps(w, vidx, 4);
+        lo = _mm256_add_pd(lo, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+        hi = _mm256_add_pd(hi, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+    }
+    double sum = hsum(_mm256_add_pd(lo, hi));
+    for (; i < n; ++i)
+        sum += w[idx[i]];
+    return sum;
+}
+
+__attribute__((target("avx2")))
+inline void gather_float_avx2(const float *w, const uint32_t *idx, size_t n, double *out)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i vidx = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx + i));
+        __m256 v = _mm256_i32gather_ps(w, vidx, 4);
+        _mm256_storeu_pd(out + i, _mm256_cvtps_pd(_mm256_castps256_ps128(v)));
+        _mm256_storeu_pd(out + i + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+    }
+    for (; i < n; ++i)
+        out[i] = w[idx[i]];
+}
+
+/** Gather 8 int16 weights, sign extended to 32 bits. Loads 32 bits at each
+ * index, so the table needs one element of padding. */
+__attribute__((target("avx2")))
+inline __m256i gather_int16_avx2(const int16_t *w, const uint32_t *idx)
+{
+    __m256i vidx = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx));
+    __m256i v = _mm256_i32gather_epi32(reinterpret_cast<const int *>(w), vidx, 2);
+    return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+__attribute__((target("avx2")))
+inline int64_t sum_int16_avx2(const int16_t *w, const uint32_t *idx, size_t n)
+{
+    // an int32 lane holds at least 2^16 int16 values before it can overflow
+    constexpr size_t FLUSH = size_t{8} << 16;
+    int64_t sum = 0;
+    size_t i = 0;
+    while (i + 8 <= n)
+    {
+        __m256i acc = _mm256_setzero_si256();
+        for (size_t end = std::min(n, i + FLUSH); i + 8 <= end; i += 8)
+            acc = _mm256_add_epi32(acc, gather_int16_avx2(w, idx + i));
+        alignas(32) int32_t lanes[8];
+        _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), acc);
+        for (int32_t lane : lanes)
+            sum += lane;
+    }
+    for (; i < n; ++i)
+        sum += w[idx[i]];
+    return sum;
+}
+
+__attribute__((target("avx2")))
+inline void gather_int16_avx2(const int16_t *w, const uint32_t *idx, size_t n, double scale,
+                              double *out)
+{
+    __m256d vscale = _mm256_set1_pd(scale);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i v = gather_int16_avx2(w, idx + i);
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(vscale, _mm256_cvtepi32_pd(_mm256_castsi256_si128(v))));
+        _mm256_storeu_pd(out + i + 4, _mm256_mul_pd(vscale, _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1))));
+    }
+    for (; i < n; ++i)
+        out[i] = scale * w[idx[i]];
+}
+#endif
+
+/** Load and store a weight that other threads may write concurrently. Torn
+ * reads and writes cannot happen, but nothing is ordered. */
+template <typename T>
+T load_relaxed(const T& w)
+{
+#if defined(__GNUC__)
+    T v;
+    __atomic_load(&w, &v, __ATOMIC_RELAXED);
+    return v;
+#else
+    return w;
+#endif
+}
+
+template <typename T>
+void store_relaxed(T& w, T v)
+{
+#if defined(__GNUC__)
+    __atomic_store(&w, &v, __ATOMIC_RELAXED);
+#else
+    w = v;
+#endif
+}
+
+} // namespace detail
+
+/**
+ * `Weight::add(w, delta)` for a weight that other threads update
+ * concurrently, Hogwild style (see `train_hogwild` in
+ * `parallel_training.hpp`): the weight is loaded and stored with relaxed
+ * atomics, without a lock or a compare-and-swap loop, so an update that
+ * races with another one to the same weight can be lost.
+ */
+template <typename Weight>
+void add_relaxed(typename Weight::value_type& w, double delta)
+{
+    typename Weight::value_type v = detail::load_relaxed(w);
+    Weight::add(v, delta);
+    detail::store_relaxed(w, v);
+}
+
+/** Weights in double precision, summed in index order. There is no double
+ * gather kernel, but the loads are prefetched. */
+struct DoubleWeight
+{
+    using value_type = double;
+    static constexpr size_t padding = 0;
+    static constexpr uint32_t snapshot_id = 1;
+    static constexpr double resolution = 0.0;
+    static constexpr size_t PREFETCH_DISTANCE = 16;
+
+    static void add(double& w, double delta) { w += delta; }
+    static double value(double w) { return w; }
+
+    static double sum(const double *w, const uint32_t *idx, size_t n)
+    {
+        double sum = 0.0;
+        for (size_t i = 0; i < n; ++i)
+        {
+#if defined(__GNUC__)
+            if (i + PREFETCH_DISTANCE < n)
+                __builtin_prefetch(&w[idx[i + PREFETCH_DISTANCE]]);
+#endif
+            sum += w[idx[i]];
+        }
+        return sum;
+    }
+
+    static void gather(const double *w, const uint32_t *idx, size_t n, double *out)
+    {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = w[idx[i]];
+    }
+};
+
+/** Weights in single precision, summed in double precision. */
+struct FloatWeight
+{
+    using value_type = float;
+    static constexpr size_t padding = 0;
+    static constexpr uint32_t snapshot_id = 2;
+    static constexpr double resolution = 0.0;
+
+    static void add(float& w, double delta) { w += static_cast<float>(delta); }
+    static double value(float w) { return w; }
+
+    static double sum(const float *w, const uint32_t *idx, size_t n)
+    {
+#if defined(BDAP_AVX2_KERNELS)
+        if (detail::has_avx2())
+            return detail::sum_float_avx2(w, idx, n);
+#endif
+        double sum = 0.0;
+        for (size_t i = 0; i < n; ++i)
+            sum += w[idx[i]];
+        return sum;
+    }
+
+    static void gather(const float *w, const uint32_t *idx, size_t n, double *out)
+    {
+#if defined(BDAP_AVX2_KERNELS)
+        if (detail::has_avx2())
+        {
+            detail::gather_float_avx2(w, idx, n, out);
+            return;
+        }
+#endif
+        for (size_t i = 0; i < n; ++i)
+            out[i] = w[idx[i]];
+    }
+};
+
+/**
+ * Fixed-point weights in 16 bits, in units of `1/SCALE`, that stick at the
+ * limits of `int16_t`. With a learning rate of 0.8, a weight can take about
+ * 1300 steps in either direction. A learning rate below `1 / (2 * SCALE)`
+ * would round every update to 0, so the perceptrons reject it.
+ */
+struct Fixed16Weight
+{
+    using value_type = int16_t;
+    static constexpr size_t padding = 1;
+    static constexpr uint32_t snapshot_id = 3;
+    static constexpr double SCALE = 16.0;
+    static constexpr double resolution = 1.0 / SCALE;
+
+    static void add(int16_t& w, double delta)
+    {
+        long v = w + std::lround(delta * SCALE);
+        v = std::max<long>(v, std::numeric_limits<int16_t>::min());
+        v = std::min<long>(v, std::numeric_limits<int16_t>::max());
+        w = static_cast<int16_t>(v);
+    }
+
+    static double value(int16_t w) { return w / SCALE; }
+
+    static double sum(const int16_t *w, const uint32_t *idx, size_t n)
+    {
+#if defined(BDAP_AVX2_KERNELS)
+        if (detail::has_avx2())
+            return detail::sum_int16_avx2(w, idx, n) / SCALE;
+#endif
+        int64_t sum = 0;
+        for (size_t i = 0; i < n; ++i)
+            sum += w[idx[i]];
+        return sum / SCALE;
+    }
+
+    static void gather(const int16_t *w, const uint32_t *idx, size_t n, double *out)
+    {
+#if defined(BDAP_AVX2_KERNELS)
+        if (detail::has_avx2())
+        {
+            detail::gather_int16_avx2(w, idx, n, 1.0 / SCALE, out);
+            return;
+        }
+#endif
+        for (size_t i = 0; i < n; ++i)
+            out[i] = w[idx[i]] / SCALE;
+    }
+};
+
+} // namespace bdap